@@ -0,0 +1,434 @@
+/*
+   Benchmark for rbtree: make bench BENCH_ARGS="-n 1000000 -d zipf ..."
+
+   Keys are generated up front, so nothing but the tree operation (and the
+   clock read around it) is timed. Key i of the tree is 2i; the odd keys in
+   between are the misses and the keys inserted by the mixed phase.
+
+   Phases, each over n operations:
+     insert      rb_upsert of every key, in distribution order
+     (shape)     rb_tree_profile of the full tree
+     search-hit  rb_find of present keys, drawn from the distribution
+     search-miss rb_find of absent keys, drawn the same way
+     iterate     rb_iter_next over the whole tree (per-node cost, no percentiles)
+     mixed       -m READ,INSERT,DELETE percentages of search/insert/delete
+     delete      rb_delete_key of every remaining key, in distribution order
+
+   Distributions (-d): seq (ascending), reverse, uniform (random permutation,
+   or uniform draws for searches) and zipf (inserts in random order, searches
+   Zipf-distributed over ranks with exponent -z, hot ranks scattered over the
+   key space).
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "rbtree.h"
+
+enum bench_dist{
+	DIST_SEQ,
+	DIST_REVERSE,
+	DIST_UNIFORM,
+	DIST_ZIPF
+};
+
+struct bench_config{
+	size_t n;
+	enum bench_dist dist;
+	size_t key_len;		/* 0: int64 keys, otherwise zero-padded decimal strings */
+	double zipf_s;
+	unsigned int mix[3];	/* search, insert, delete percentages of the mixed phase */
+	size_t pool_chunk_nodes;
+	uint64_t seed;
+};
+
+struct bench_keys{
+	char* bytes;
+	size_t stride;
+	size_t len;
+};
+
+/* splitmix64: small, fast and good enough to drive a benchmark. */
+static uint64_t bench_rand(uint64_t* state){
+
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+
+static double bench_unit(uint64_t* state){
+
+	return (bench_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+static uint64_t bench_now(){
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+
+/* Zipf sampler of Gray et al., "Quickly generating billion-record synthetic
+   databases" (as used by YCSB): O(n) setup, O(1) per draw, ranks 0..n-1.
+   Only valid for 0 < theta < 1. */
+struct bench_zipf{
+	size_t n;
+	double theta, alpha, zetan, eta;
+};
+
+static void bench_zipf_init(struct bench_zipf* z, size_t n, double theta){
+
+	double zeta2 = 1.0 + pow(0.5, theta);
+
+	z->n = n;
+	z->theta = theta;
+	z->zetan = 0;
+	for (size_t i = 1; i <= n; i++)
+		z->zetan += 1.0 / pow((double) i, theta);
+	z->alpha = 1.0 / (1.0 - theta);
+	z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+
+static size_t bench_zipf_next(struct bench_zipf* z, uint64_t* state){
+
+	double u = bench_unit(state);
+	double uz = u * z->zetan;
+	size_t rank;
+
+	if (uz < 1.0)
+		return 0;
+	if (uz < 1.0 + pow(0.5, z->theta))
+		return 1;
+	rank = (size_t) (z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+	return rank < z->n ? rank : z->n - 1;
+}
+
+
+/* The order in which phases visit key indices 0..n-1. */
+static size_t* bench_order(const struct bench_config* config, bool draws, struct bench_zipf* zipf, uint64_t* state){
+
+	size_t n = config->n;
+	size_t* order = malloc(n * sizeof(size_t));
+	size_t i, j, t;
+
+	for (i = 0; i < n; i++)
+		order[i] = (config->dist == DIST_REVERSE) ? n - 1 - i : i;
+
+	if (config->dist == DIST_ZIPF && draws){
+		/* Rank r maps to a fixed pseudo-random index so the hot keys are
+		   spread over the tree rather than clustered at one end. */
+		for (i = 0; i < n; i++){
+			uint64_t r = bench_zipf_next(zipf, state);
+			order[i] = (size_t) ((r * 0x9E3779B97F4A7C15ull) % n);
+		}
+	}
+	else if (config->dist == DIST_UNIFORM && draws){
+		for (i = 0; i < n; i++)
+			order[i] = (size_t) (bench_rand(state) % n);
+	}
+	else if (config->dist == DIST_UNIFORM || config->dist == DIST_ZIPF){
+		for (i = n - 1; i > 0; i--){
+			j = (size_t) (bench_rand(state) % (i + 1));
+			t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+	}
+	return order;
+}
+
+
+/* Keys 0..2n-1: index i of the tree is key 2i, miss i is key 2i + 1. */
+static void bench_keys_init(struct bench_keys* keys, const struct bench_config* config){
+
+	size_t count = config->n * 2;
+
+	keys->len = config->key_len ? config->key_len : sizeof(int64_t);
+	keys->stride = keys->len + 1;
+	keys->bytes = malloc(count * keys->stride);
+	for (size_t i = 0; i < count; i++){
+		char* key = keys->bytes + i * keys->stride;
+		if (config->key_len == 0){
+			int64_t k = (int64_t) i;
+			memcpy(key, &k, sizeof(k));
+		}
+		else {
+			snprintf(key, keys->stride, "%0*zu", (int) config->key_len, i);
+		}
+	}
+}
+
+
+static inline const char* bench_key(const struct bench_keys* keys, size_t i){
+
+	return keys->bytes + i * keys->stride;
+}
+
+
+static int bench_cmp_u32(const void* a, const void* b){
+
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+	return (x > y) - (x < y);
+}
+
+
+struct bench_result{
+	const char* name;
+	size_t ops;
+	uint64_t elapsed;
+	uint32_t* latency;	/* per-op ns, or NULL */
+};
+
+static void bench_report(struct bench_result* r){
+
+	double ns = r->ops ? (double) r->elapsed / r->ops : 0;
+
+	printf("%-12s %10zu %10.1f %12.0f", r->name, r->ops, ns, ns > 0 ? 1e9 / ns : 0);
+	if (r->latency != NULL && r->ops > 0){
+		qsort(r->latency, r->ops, sizeof(uint32_t), bench_cmp_u32);
+		printf(" %8u %8u %8u\n",
+		       r->latency[r->ops / 2],
+		       r->latency[(size_t) (r->ops * 0.99)],
+		       r->latency[(size_t) (r->ops * 0.999)]);
+	}
+	else {
+		printf(" %8s %8s %8s\n", "-", "-", "-");
+	}
+}
+
+
+/* One op's time less one clock read, the cost bracketing it adds. */
+static uint32_t bench_clip(uint64_t ns, uint64_t overhead){
+
+	ns = ns > overhead ? ns - overhead : 0;
+	return ns > UINT32_MAX ? UINT32_MAX : (uint32_t) ns;
+}
+
+
+/* Time since start less the two clock reads each of ops timed ops made. */
+static uint64_t bench_elapsed(uint64_t start, size_t ops, uint64_t overhead){
+
+	uint64_t elapsed = bench_now() - start;
+	uint64_t clocks = 2 * overhead * ops;
+
+	return elapsed > clocks ? elapsed - clocks : 0;
+}
+
+
+static void bench_usage(const char* argv0){
+
+	fprintf(stderr,
+		"usage: %s [-n N] [-d seq|reverse|uniform|zipf] [-k KEY_LEN] [-z ZIPF_S]\n"
+		"          [-m READ,INSERT,DELETE] [-p POOL_CHUNK_NODES] [-s SEED]\n"
+		"  -k 0 (default) uses int64 keys; otherwise fixed-length string keys\n"
+		"  -z must lie in (0, 1); default 0.99\n",
+		argv0);
+	exit(2);
+}
+
+
+int main(int argc, char** argv){
+
+	struct bench_config config = { 1000000, DIST_UNIFORM, 0, 0.99, { 90, 5, 5 }, 0, 1 };
+	struct rb_tree_options options = {0};
+	struct bench_zipf zipf;
+	struct bench_keys keys;
+	struct bench_result result;
+	struct rb_tree* tree;
+	struct rb_iter iter;
+	struct rb_profile profile;
+	struct rb_node* node;
+	size_t *order, *draws, i, visited, next_insert, next_delete;
+	uint64_t state, start, t0, overhead;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:d:k:z:m:p:s:")) != -1){
+		switch (opt){
+		case 'n':
+			config.n = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			if (!strcmp(optarg, "seq"))
+				config.dist = DIST_SEQ;
+			else if (!strcmp(optarg, "reverse"))
+				config.dist = DIST_REVERSE;
+			else if (!strcmp(optarg, "uniform"))
+				config.dist = DIST_UNIFORM;
+			else if (!strcmp(optarg, "zipf"))
+				config.dist = DIST_ZIPF;
+			else
+				bench_usage(argv[0]);
+			break;
+		case 'k':
+			config.key_len = strtoull(optarg, NULL, 10);
+			break;
+		case 'z':
+			config.zipf_s = strtod(optarg, NULL);
+			break;
+		case 'm':
+			if (sscanf(optarg, "%u,%u,%u", &config.mix[0], &config.mix[1], &config.mix[2]) != 3 ||
+			    config.mix[0] + config.mix[1] + config.mix[2] != 100)
+				bench_usage(argv[0]);
+			break;
+		case 'p':
+			config.pool_chunk_nodes = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			config.seed = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			bench_usage(argv[0]);
+		}
+	}
+	if (config.n < 2 || !(config.zipf_s > 0 && config.zipf_s < 1))
+		bench_usage(argv[0]);
+	/* String keys must be wide enough for 2n - 1. */
+	if (config.key_len != 0 && snprintf(NULL, 0, "%zu", config.n * 2 - 1) > (int) config.key_len){
+		fprintf(stderr, "-k %zu is too short for -n %zu\n", config.key_len, config.n);
+		return 2;
+	}
+
+	state = config.seed;
+	bench_keys_init(&keys, &config);
+	if (config.dist == DIST_ZIPF)
+		bench_zipf_init(&zipf, config.n, config.zipf_s);
+
+	start = bench_now();
+	for (i = 0; i < 1000000; i++)
+		bench_now();
+	overhead = (bench_now() - start) / 1000000;
+
+	options.key_type = config.key_len ? RB_KEY_STRING : RB_KEY_INT64;
+	options.pool_chunk_nodes = config.pool_chunk_nodes;
+	tree = rb_tree_alloc_with(&options);
+
+	printf("n=%zu dist=%s key_len=%zu%s pool=%zu seed=%llu mix=%u,%u,%u timer=%llu ns (subtracted from timed ops)\n",
+	       config.n,
+	       (const char*[]){ "seq", "reverse", "uniform", "zipf" }[config.dist],
+	       keys.len, config.key_len ? "" : " (int64)",
+	       config.pool_chunk_nodes, (unsigned long long) config.seed,
+	       config.mix[0], config.mix[1], config.mix[2], (unsigned long long) overhead);
+	printf("%-12s %10s %10s %12s %8s %8s %8s\n", "op", "ops", "ns/op", "ops/s", "p50", "p99", "p999");
+
+	result.latency = malloc(config.n * sizeof(uint32_t));
+	order = bench_order(&config, false, &zipf, &state);
+	draws = bench_order(&config, true, &zipf, &state);
+
+	result.name = "insert";
+	result.ops = config.n;
+	start = bench_now();
+	for (i = 0; i < config.n; i++){
+		const char* key = bench_key(&keys, order[i] * 2);
+		t0 = bench_now();
+		rb_upsert(tree, key, keys.len, NULL);
+		result.latency[i] = bench_clip(bench_now() - t0, overhead);
+	}
+	result.elapsed = bench_elapsed(start, result.ops, overhead);
+	bench_report(&result);
+
+	rb_tree_profile(tree, &profile);
+	printf("# shape: height %u, black height %u, average depth %.2f, %.2f lines/lookup, %zu node bytes, %zu key bytes\n",
+	       profile.height, profile.black_height, profile.average_depth,
+	       profile.cache_lines_per_lookup, profile.node_bytes, profile.key_bytes);
+
+	result.name = "search-hit";
+	start = bench_now();
+	for (i = 0; i < config.n; i++){
+		const char* key = bench_key(&keys, draws[i] * 2);
+		t0 = bench_now();
+		node = rb_find(tree, key, keys.len);
+		result.latency[i] = bench_clip(bench_now() - t0, overhead);
+		if (node == NULL){
+			fprintf(stderr, "search-hit: key %zu missing\n", draws[i] * 2);
+			return 1;
+		}
+	}
+	result.elapsed = bench_elapsed(start, result.ops, overhead);
+	bench_report(&result);
+
+	result.name = "search-miss";
+	start = bench_now();
+	for (i = 0; i < config.n; i++){
+		const char* key = bench_key(&keys, draws[i] * 2 + 1);
+		t0 = bench_now();
+		node = rb_find(tree, key, keys.len);
+		result.latency[i] = bench_clip(bench_now() - t0, overhead);
+		if (node != NULL){
+			fprintf(stderr, "search-miss: key %zu present\n", draws[i] * 2 + 1);
+			return 1;
+		}
+	}
+	result.elapsed = bench_elapsed(start, result.ops, overhead);
+	bench_report(&result);
+
+	result.name = "iterate";
+	visited = 0;
+	start = bench_now();
+	for (node = rb_iter_first(&iter, tree); node != NULL; node = rb_iter_next(&iter))
+		visited++;
+	result.elapsed = bench_now() - start;
+	result.ops = visited;
+	{
+		uint32_t* latency = result.latency;
+		result.latency = NULL;
+		bench_report(&result);
+		result.latency = latency;
+	}
+
+	/* Mixed: inserts add misses in order, deletes remove tree keys in order. */
+	result.name = "mixed";
+	result.ops = config.n;
+	next_insert = next_delete = 0;
+	start = bench_now();
+	for (i = 0; i < config.n; i++){
+		unsigned int pick = (unsigned int) (bench_rand(&state) % 100);
+
+		/* Once every original key is deleted, deletes turn into searches. */
+		if (pick >= config.mix[0] + config.mix[1] && next_delete == config.n)
+			pick = 0;
+		if (pick < config.mix[0]){
+			const char* key = bench_key(&keys, draws[i] * 2);
+			t0 = bench_now();
+			rb_find(tree, key, keys.len);
+		}
+		else if (pick < config.mix[0] + config.mix[1]){
+			const char* key = bench_key(&keys, order[next_insert++ % config.n] * 2 + 1);
+			t0 = bench_now();
+			rb_upsert(tree, key, keys.len, NULL);
+		}
+		else {
+			const char* key = bench_key(&keys, order[next_delete++] * 2);
+			t0 = bench_now();
+			rb_delete_key(tree, key, keys.len);
+		}
+		result.latency[i] = bench_clip(bench_now() - t0, overhead);
+	}
+	result.elapsed = bench_elapsed(start, result.ops, overhead);
+	bench_report(&result);
+
+	result.name = "delete";
+	result.ops = 0;
+	start = bench_now();
+	for (i = next_delete; i < config.n; i++){
+		const char* key = bench_key(&keys, order[i] * 2);
+		t0 = bench_now();
+		rb_delete_key(tree, key, keys.len);
+		result.latency[result.ops++] = bench_clip(bench_now() - t0, overhead);
+	}
+	result.elapsed = bench_elapsed(start, result.ops, overhead);
+	bench_report(&result);
+
+	rb_tree_destroy(tree, NULL, NULL);
+	free(result.latency);
+	free(order);
+	free(draws);
+	free(keys.bytes);
+	return 0;
+}
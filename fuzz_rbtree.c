@@ -0,0 +1,233 @@
+/*
+   Fuzz harness for rbtree: random insert/delete/search sequences checked by
+   rb_tree_validate after every change and against a bitmap of present keys.
+
+   Input: the first byte picks the tree's options (FUZZ_OPT_*), then every 3
+   bytes are one operation (opcode byte mod 5, 16-bit key folded into FUZZ_KEYS
+   so keys collide):
+     0  rb_upsert            1  rb_delete_key
+     2  rb_find, widening the interval of a found node on interval trees
+     3  rb_insert_hint (absent key) or rb_finger_search
+     4  rb_find then rb_delete and rb_tree_free_node
+   Any mismatch or invariant violation aborts, which both fuzzers report.
+
+   libFuzzer: make fuzz_libfuzzer  (clang, -DRB_FUZZ_LIBFUZZER)
+   AFL:       afl-gcc ... fuzz_rbtree.c rbtree.c, then afl-fuzz with stdin input
+   Standalone: ./fuzz_rbtree.o < input, or ./fuzz_rbtree.o -r RUNS [-s SEED]
+               for RUNS random inputs (what make fuzz does).
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "rbtree.h"
+
+#define FUZZ_KEYS 1024
+#define FUZZ_OPT_ORDER_STATS 1
+#define FUZZ_OPT_POOL 2
+#define FUZZ_OPT_STRING 4		/* ignored for interval trees, which key by int64 */
+#define FUZZ_OPT_INTERVAL 8
+#define FUZZ_OPT_AGGREGATE 16
+
+static const char *fuzz_violations[] = {
+	"valid", "bad sentinel", "red root", "bad parent", "bad order",
+	"red node with a red child", "unequal black heights", "bad augmented field", "bad max"
+};
+
+
+static void fuzz_fail(const char *what, unsigned int key){
+
+	fprintf(stderr, "fuzz_rbtree: %s (key %u)\n", what, key);
+	abort();
+}
+
+
+static void fuzz_check(struct rb_tree *tree, unsigned int key){
+
+	enum rb_violation violation = rb_tree_validate(tree);
+
+	if (violation != RB_VALID)
+		fuzz_fail(fuzz_violations[violation], key);
+}
+
+
+/* Sums the first byte of every key, which covers both key types. */
+static void fuzz_sum_identity(void *out){
+
+	*(int64_t*) out = 0;
+}
+
+
+static void fuzz_sum_value(void *out, const struct rb_node *node){
+
+	*(int64_t*) out = *(const unsigned char*) node->key;
+}
+
+
+static void fuzz_sum_combine(void *out, const void *left, const void *right){
+
+	*(int64_t*) out = *(const int64_t*) left + *(const int64_t*) right;
+}
+
+
+static const struct rb_aggregate fuzz_sum = {
+	sizeof(int64_t), fuzz_sum_identity, fuzz_sum_value, fuzz_sum_combine
+};
+
+
+/* Keys are the int64 value, or its decimal string for string trees. */
+static size_t fuzz_key(bool string_keys, unsigned int key, int64_t *word, char *text){
+
+	if (!string_keys){
+		*word = key;
+		return sizeof(*word);
+	}
+	return (size_t) sprintf(text, "%u", key);
+}
+
+
+extern int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+
+	struct rb_tree_options options;
+	struct rb_tree *tree;
+	struct rb_node *node, *finger = NULL;
+	uint8_t present[FUZZ_KEYS / 8];
+	size_t count = 0, i, key_len;
+	bool string_keys, inserted;
+	int64_t word;
+	char text[8];
+	const void *key;
+
+	if (size == 0)
+		return 0;
+
+	memset(&options, 0, sizeof(options));
+	options.order_stats = (data[0] & FUZZ_OPT_ORDER_STATS) != 0;
+	options.pool_chunk_nodes = (data[0] & FUZZ_OPT_POOL) ? 64 : 0;
+	options.interval = (data[0] & FUZZ_OPT_INTERVAL) != 0;
+	options.aggregate = (data[0] & FUZZ_OPT_AGGREGATE) ? &fuzz_sum : NULL;
+	string_keys = (data[0] & FUZZ_OPT_STRING) != 0 && !options.interval;
+	options.key_type = string_keys ? RB_KEY_STRING : RB_KEY_INT64;
+	tree = rb_tree_alloc_with(&options);
+	memset(present, 0, sizeof(present));
+
+	for (i = 1; i + 3 <= size; i += 3){
+		unsigned int op = data[i] % 5;
+		unsigned int k = (((unsigned int) data[i + 1] << 8) | data[i + 2]) % FUZZ_KEYS;
+		bool was_present = (present[k / 8] >> (k % 8)) & 1;
+
+		key_len = fuzz_key(string_keys, k, &word, text);
+		key = string_keys ? (const void*) text : (const void*) &word;
+
+		switch (op){
+		case 0:
+			finger = rb_upsert(tree, key, key_len, &inserted);
+			if (inserted == was_present)
+				fuzz_fail("rb_upsert disagrees with the shadow set", k);
+			count += inserted;
+			break;
+		case 1:
+			if (rb_delete_key(tree, key, key_len) != was_present)
+				fuzz_fail("rb_delete_key disagrees with the shadow set", k);
+			count -= was_present;
+			finger = NULL;
+			break;
+		case 2:
+			node = rb_find(tree, key, key_len);
+			if ((node != NULL) != was_present)
+				fuzz_fail("rb_find disagrees with the shadow set", k);
+			if (node != NULL && options.interval){
+				rb_node_interval(node)->hi = (int64_t) k + data[i + 2] % 64;
+				rb_aggregate_refresh(tree, node);
+			}
+			break;
+		case 3:
+			node = rb_finger_search(tree, finger, key, key_len);
+			if ((node != NULL) != was_present)
+				fuzz_fail("rb_finger_search disagrees with the shadow set", k);
+			if (node == NULL){
+				node = rb_tree_node_alloc(tree, key, key_len, NULL);
+				rb_insert_hint(tree, finger, node);
+				count++;
+			}
+			finger = node;
+			break;
+		default:
+			node = rb_find(tree, key, key_len);
+			if ((node != NULL) != was_present)
+				fuzz_fail("rb_find disagrees with the shadow set", k);
+			if (node != NULL){
+				rb_delete(tree, node);
+				rb_tree_free_node(tree, node);
+				count--;
+			}
+			finger = NULL;
+			break;
+		}
+
+		if (op == 0 || op == 3)
+			present[k / 8] |= (uint8_t) (1u << (k % 8));
+		else if (op == 1 || op == 4)
+			present[k / 8] &= (uint8_t) ~(1u << (k % 8));
+		if (op != 2 || options.interval)
+			fuzz_check(tree, k);
+		if (rb_tree_size(tree) != count)
+			fuzz_fail("rb_tree_size disagrees with the shadow set", k);
+	}
+
+	rb_tree_destroy(tree, NULL, NULL);
+	return 0;
+}
+
+
+#ifndef RB_FUZZ_LIBFUZZER
+
+static uint64_t fuzz_next(uint64_t *state){
+
+	/* splitmix64 */
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+
+int main(int argc, char **argv){
+
+	static uint8_t buf[1 << 16];
+	unsigned long runs = 0, run;
+	uint64_t seed = 1, state;
+	size_t size, i;
+	int arg;
+
+	for (arg = 1; arg + 1 < argc; arg += 2){
+		if (strcmp(argv[arg], "-r") == 0)
+			runs = strtoul(argv[arg + 1], NULL, 10);
+		else if (strcmp(argv[arg], "-s") == 0)
+			seed = strtoull(argv[arg + 1], NULL, 10);
+	}
+
+	if (runs == 0){
+		size = fread(buf, 1, sizeof(buf), stdin);
+		return LLVMFuzzerTestOneInput(buf, size);
+	}
+
+	state = seed;
+	for (run = 0; run < runs; run++){
+		/* Inputs of up to ~4000 operations over a key range narrowed per run,
+		   so both sparse and dense trees (and long delete runs) come up. */
+		size = 1 + 3 * (fuzz_next(&state) % 4000);
+		for (i = 0; i < size; i++)
+			buf[i] = (uint8_t) fuzz_next(&state);
+		if (run % 2){
+			for (i = 2; i < size; i += 3)
+				buf[i - 1] = 0;
+		}
+		LLVMFuzzerTestOneInput(buf, size);
+	}
+	printf("fuzz_rbtree: %lu runs from seed %llu passed\n", runs, (unsigned long long) seed);
+	return 0;
+}
+
+#endif
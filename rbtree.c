@@ -12,8 +12,29 @@
    1. Root's parent is sentinel node, if root is a node. 
    2. Leaf nodes are also sentinel node. 
    3. All RB Tree instances will share this sentinel node for their root's parent and leaves.
+      It is a statically allocated object (rb_sentinel, RB_NIL) that is never written,
+      so leaf checks are a compare against a link-time constant and trees can be
+      created and modified from several threads.
    4. Empty root is initialized to sentinel.
    5. Unsuccessful search (rb_search) returns NULL. 
+   6. Pooled trees carve nodes out of slab chunks and key/value copies out of
+      byte chunks. Freed nodes go on a free list; their key/value bytes are only
+      reclaimed when the whole tree is destroyed.
+   7. Short keys are stored inline in the node (key_buf), so comparing against
+      them touches no memory beyond the node itself.
+   8. Each tree compares keys according to its keyType. The built-in types are
+      dispatched with a switch (rb_compare) so the hot loops make no indirect calls.
+   9. Augmented trees (tree->augment != 0) keep per-node summaries of their subtree.
+      rb_augment_node recomputes one node from its children; rotations recompute
+      the two nodes they move, and insert/delete recompute the path from the lowest
+      changed node to the root before rebalancing. The sentinel's size is 0; it has
+      no aux fields, so those are only read from real nodes.
+      User aggregates (rb_aggregate) follow the same paths, so only the O(log n)
+      nodes whose subtrees changed are recombined.
+  10. Keys and data are copied, borrowed or taken per tree (rb_ownership); every
+      path that frees them asks rb_tree_owns_key/rb_tree_owns_data first.
+  11. Parent and colour are only touched through rb_parent/rb_color and their
+      setters, so RB_COMPACT_COLOR can fold the colour into the parent pointer.
    
    Implementation based on CLRS 3rd edition.
 */
@@ -26,348 +47,1664 @@
 #define BLACK 0
 #define RED 1
 #define SENTINEL_KEY "NIL"
+#define RB_POOL_BYTES_CHUNK 65536
+#ifdef RB_STATS
+#define RB_STAT(tree, counter) ((tree)->stats.counter++)
+#else
+#define RB_STAT(tree, counter) ((void) 0)
+#endif
+
+#define RB_KEY_INLINE(node) ((node)->key == (void*) (node)->key_buf)
+#define RB_BATCH_WIDTH 16
+
+#if defined(__GNUC__)
+#define RB_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define RB_PREFETCH(addr) ((void) (addr))
+#endif
+
+
+struct rb_pool_chunk{
+	struct rb_pool_chunk* next;
+	size_t used;
+	size_t capacity;
+};
+
+struct rb_pool{
+	struct rb_pool_chunk* node_chunks;
+	struct rb_pool_chunk* byte_chunks;
+	struct rb_node* free_list;	/* linked through left */
+	size_t chunk_nodes;
+	size_t node_size;
+};
+
+static void* rb_pool_bytes(struct rb_pool*, size_t);
+static char* rb_tree_copy_value(struct rb_tree*, char*);
+static void rb_delete_rebalance(struct rb_tree*, struct rb_node*, struct rb_node*);
+
+
+struct rb_node rb_sentinel = {
+#ifdef RB_COMPACT_COLOR
+	.parent_color = 0,	/* NULL, BLACK */
+#else
+	.parent = NULL,
+	.color = BLACK,
+#endif
+	.left = NULL,
+	.right = NULL,
+	.key = SENTINEL_KEY,
+	.key_len = sizeof(SENTINEL_KEY) - 1
+};
 
 
 struct rb_node *SENTINEL(){
 
-	static struct rb_node *sentinel;
-	if (sentinel == NULL){
-		sentinel = (struct rb_node *) malloc(sizeof(struct rb_node));
-		sentinel->color =  BLACK;
-		sentinel->left = NULL;
-		sentinel->right = NULL;
-		sentinel->parent = NULL;
-		sentinel->key = SENTINEL_KEY;
+	return RB_NIL;
+}
+
+
+/* Stores key in the node: inline when it fits, otherwise as the caller's pointer
+   (RB_BORROW, RB_TAKE) or as a copy in the pool (when given) or on the heap.
+   Copies are always NUL terminated. */
+static void rb_node_set_key(struct rb_node* node, struct rb_pool* pool, const char* key, size_t len,
+			    enum rb_ownership ownership){
+
+	if (len >= RB_INLINE_KEY_SIZE && ownership != RB_COPY){
+		node->key = (void*) key;
+		node->key_len = (uint32_t) len;
+		return;
+	}
+
+	if (len < RB_INLINE_KEY_SIZE)
+		node->key = node->key_buf;
+	else if (pool != NULL)
+		node->key = rb_pool_bytes(pool, len + 1);
+	else
+		node->key = malloc(len + 1);
+
+	memcpy(node->key, key, len);
+	((char*) node->key)[len] = '\0';
+	node->key_len = (uint32_t) len;
+	if (ownership == RB_TAKE)
+		free((void*) key);
+}
+
+
+static inline bool rb_tree_owns_key(struct rb_tree* tree, struct rb_node* node){
+
+	if (RB_KEY_INLINE(node))
+		return false;
+	return tree->key_ownership == RB_TAKE || (tree->key_ownership == RB_COPY && tree->pool == NULL);
+}
+
+
+/* True when the tree copies keys or data (per ownership) into its pool. */
+static inline bool rb_tree_pools(struct rb_tree* tree, enum rb_ownership ownership){
+
+	return ownership == RB_COPY && tree->pool != NULL;
+}
+
+
+/* True when releasing keys or data held this way has anything to free or hand to fn. */
+static inline bool rb_tree_releases(enum rb_ownership ownership, rb_free_fn fn){
+
+	return ownership == RB_TAKE || (ownership == RB_BORROW && fn != NULL);
+}
+
+
+static inline bool rb_tree_owns_data(struct rb_tree* tree){
+
+	return tree->data_ownership == RB_TAKE || (tree->data_ownership == RB_COPY && tree->pool == NULL);
+}
+
+
+static inline int rb_compare(struct rb_tree* tree, const void* a, size_t a_len, const void* b, size_t b_len){
+
+	RB_STAT(tree, compares);
+	return rb_compare_keys(tree->keyType, tree->compare, a, a_len, b, b_len);
+}
+
+
+static inline void* rb_node_agg(struct rb_tree* tree, struct rb_node* node){
+
+	return (char*) node->aux + tree->aggregate_offset;
+}
+
+
+/* Subtree size of an order_stats tree's node; the sentinel has no aux fields. */
+static inline size_t* rb_node_size_field(struct rb_tree* tree, struct rb_node* node){
+
+	return (size_t*) ((char*) node->aux + tree->size_offset);
+}
+
+
+static inline size_t rb_node_size(struct rb_tree* tree, struct rb_node* node){
+
+	return node == RB_NIL ? 0 : *rb_node_size_field(tree, node);
+}
+
+
+/* acc = acc (+) right */
+static void rb_agg_append(struct rb_tree* tree, void* acc, const void* right){
+
+	uint64_t joined[RB_AGGREGATE_MAX / sizeof(uint64_t)];
+
+	tree->aggregate.combine(joined, acc, right);
+	memcpy(acc, joined, tree->aggregate.size);
+}
+
+
+/* acc = left (+) acc */
+static void rb_agg_prepend(struct rb_tree* tree, void* acc, const void* left){
+
+	uint64_t joined[RB_AGGREGATE_MAX / sizeof(uint64_t)];
+
+	tree->aggregate.combine(joined, left, acc);
+	memcpy(acc, joined, tree->aggregate.size);
+}
+
+
+static void rb_agg_recompute(struct rb_tree* tree, struct rb_node* node){
+
+	uint64_t acc[RB_AGGREGATE_MAX / sizeof(uint64_t)];
+	uint64_t value[RB_AGGREGATE_MAX / sizeof(uint64_t)];
+
+	tree->aggregate.value(value, node);
+	if (node->left != RB_NIL){
+		memcpy(acc, rb_node_agg(tree, node->left), tree->aggregate.size);
+		rb_agg_append(tree, acc, value);
+	}
+	else {
+		memcpy(acc, value, tree->aggregate.size);
+	}
+	if (node->right != RB_NIL)
+		rb_agg_append(tree, acc, rb_node_agg(tree, node->right));
+	memcpy(rb_node_agg(tree, node), acc, tree->aggregate.size);
+}
+
+
+/* Recomputes node's augmented fields from its children. */
+static inline void rb_augment_node(struct rb_tree* tree, struct rb_node* node){
+
+	struct rb_interval* interval;
+	int64_t max_hi;
+
+	if (tree->augment & RB_AUGMENT_SIZE)
+		*rb_node_size_field(tree, node) = rb_node_size(tree, node->left) + rb_node_size(tree, node->right) + 1;
+
+	if (tree->augment & RB_AUGMENT_INTERVAL){
+		interval = (struct rb_interval*) node->aux;
+		max_hi = interval->hi;
+		if (node->left != RB_NIL && ((struct rb_interval*) node->left->aux)->max_hi > max_hi)
+			max_hi = ((struct rb_interval*) node->left->aux)->max_hi;
+		if (node->right != RB_NIL && ((struct rb_interval*) node->right->aux)->max_hi > max_hi)
+			max_hi = ((struct rb_interval*) node->right->aux)->max_hi;
+		interval->max_hi = max_hi;
+	}
+
+	if (tree->augment & RB_AUGMENT_AGGREGATE)
+		rb_agg_recompute(tree, node);
+}
+
+
+static void rb_augment_path(struct rb_tree* tree, struct rb_node* node){
+
+	if (!tree->augment)
+		return;
+	while (node != RB_NIL){
+		rb_augment_node(tree, node);
+		node = rb_parent(node);
+	}
+}
+
+
+extern struct rb_tree *rb_tree_alloc(){
+
+	return rb_tree_alloc_with(NULL);
+}
+
+
+extern struct rb_tree *rb_tree_alloc_with(const struct rb_tree_options* options){
+
+	struct rb_tree* tree;
+	tree = (struct rb_tree*) malloc(sizeof(struct rb_tree));
+	memset(tree, 0, sizeof(*tree));
+	tree->root = RB_NIL;
+	tree->max = RB_NIL;
+	tree->keyType = RB_KEY_STRING;
+	tree->compare = STRING_COMPARE;
+	tree->node_size = sizeof(struct rb_node);
+
+	if (options != NULL){
+		tree->key_ownership = options->key_ownership;
+		tree->data_ownership = options->data_ownership;
+		tree->keyType = rb_key_type_resolve(options->key_type, options->compare,
+						    &tree->compare, &tree->key_size);
+		if (tree->compare == NULL){
+			free(tree);
+			return NULL;
+		}
+	}
+
+	/* The interval comes first: rb_node_interval finds it without the tree. */
+	if (options != NULL && options->interval){
+		tree->augment |= RB_AUGMENT_INTERVAL;
+		tree->keyType = rb_key_type_resolve(RB_KEY_INT64, NULL, &tree->compare, &tree->key_size);
+		tree->aux_size += sizeof(struct rb_interval);
+	}
+
+	if (options != NULL && options->order_stats){
+		tree->augment |= RB_AUGMENT_SIZE;
+		tree->size_offset = tree->aux_size;
+		tree->aux_size += sizeof(size_t);
+	}
+
+	if (options != NULL && options->aggregate != NULL){
+		if (options->aggregate->size == 0 || options->aggregate->size > RB_AGGREGATE_MAX){
+			free(tree);
+			return NULL;
+		}
+		tree->augment |= RB_AUGMENT_AGGREGATE;
+		tree->aggregate = *options->aggregate;
+		tree->aggregate_offset = tree->aux_size;
+		tree->aux_size += (tree->aggregate.size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+	}
+	tree->node_size += tree->aux_size;
+
+	if (options != NULL && options->pool_chunk_nodes > 0){
+		tree->pool = (struct rb_pool*) malloc(sizeof(struct rb_pool));
+		memset(tree->pool, 0, sizeof(*tree->pool));
+		tree->pool->chunk_nodes = options->pool_chunk_nodes;
+		tree->pool->node_size = tree->node_size;
+	}
+	return tree;
+}
+
+
+static struct rb_pool_chunk* rb_pool_chunk_alloc(size_t capacity){
+
+	struct rb_pool_chunk* chunk = malloc(sizeof(struct rb_pool_chunk) + capacity);
+	chunk->next = NULL;
+	chunk->used = 0;
+	chunk->capacity = capacity;
+	return chunk;
+}
+
+
+static struct rb_node* rb_pool_node(struct rb_pool* pool){
+
+	struct rb_pool_chunk* chunk = pool->node_chunks;
+	struct rb_node* node;
+
+	if (pool->free_list != NULL){
+		node = pool->free_list;
+		pool->free_list = node->left;
+		return node;
+	}
+	if (chunk == NULL || chunk->used == chunk->capacity){
+		chunk = rb_pool_chunk_alloc(pool->chunk_nodes * pool->node_size);
+		chunk->next = pool->node_chunks;
+		pool->node_chunks = chunk;
+	}
+	node = (struct rb_node*) ((char*) (chunk + 1) + chunk->used);
+	chunk->used += pool->node_size;
+	return node;
+}
+
+
+static void* rb_pool_bytes(struct rb_pool* pool, size_t size){
+
+	struct rb_pool_chunk* chunk = pool->byte_chunks;
+	void* bytes;
+
+	if (size > RB_POOL_BYTES_CHUNK / 4){
+		/* Large copies get a chunk of their own behind the current one,
+		   so the remainder of the current chunk isn't wasted. */
+		chunk = rb_pool_chunk_alloc(size);
+		chunk->used = size;
+		if (pool->byte_chunks != NULL){
+			chunk->next = pool->byte_chunks->next;
+			pool->byte_chunks->next = chunk;
+		}
+		else {
+			pool->byte_chunks = chunk;
+		}
+		return chunk + 1;
+	}
+	if (chunk == NULL || chunk->capacity - chunk->used < size){
+		chunk = rb_pool_chunk_alloc(RB_POOL_BYTES_CHUNK);
+		chunk->next = pool->byte_chunks;
+		pool->byte_chunks = chunk;
+	}
+	bytes = (char*) (chunk + 1) + chunk->used;
+	chunk->used += size;
+	return bytes;
+}
+
+
+static void rb_pool_chunks_free(struct rb_pool_chunk* chunk){
+
+	struct rb_pool_chunk* next;
+
+	while (chunk != NULL){
+		next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+
+/* Keeps the newest chunk of a list for reuse and frees the rest. */
+static void rb_pool_chunks_reset(struct rb_pool_chunk** chunks){
+
+	if (*chunks == NULL)
+		return;
+	rb_pool_chunks_free((*chunks)->next);
+	(*chunks)->next = NULL;
+	(*chunks)->used = 0;
+}
+
+
+/* Releases one node's key and data the way rb_tree_destroy documents. */
+static void rb_tree_release_node(struct rb_tree* tree, struct rb_node* node,
+				 rb_free_fn free_key, rb_free_fn free_data){
+
+	/* Copies in the pool's chunks go with them, whatever the callbacks. */
+	if (!RB_KEY_INLINE(node) && !rb_tree_pools(tree, tree->key_ownership)){
+		if (free_key != NULL)
+			free_key(node->key);
+		else if (rb_tree_owns_key(tree, node))
+			free(node->key);
+	}
+
+	if (node->data != NULL && !rb_tree_pools(tree, tree->data_ownership)){
+		if (free_data != NULL)
+			free_data(node->data);
+		else if (rb_tree_owns_data(tree))
+			free(node->data);
+	}
+}
+
+
+/* Post-order walk on parent pointers: release a node once both of its
+   subtrees are gone, then continue from its parent. O(n), constant space. */
+static void rb_tree_release(struct rb_tree* tree, rb_free_fn free_key, rb_free_fn free_data){
+
+	struct rb_node* node = tree->root;
+	struct rb_node* parent;
+
+	/* Pooled nodes and copies go with their chunks; nothing to visit. */
+	if (tree->pool != NULL && !rb_tree_releases(tree->key_ownership, free_key) &&
+	    !rb_tree_releases(tree->data_ownership, free_data))
+		node = RB_NIL;
+
+	while (node != RB_NIL){
+		if (node->left != RB_NIL){
+			node = node->left;
+		}
+		else if (node->right != RB_NIL){
+			node = node->right;
+		}
+		else {
+			parent = rb_parent(node);
+			if (parent != RB_NIL){
+				if (parent->left == node)
+					parent->left = RB_NIL;
+				else
+					parent->right = RB_NIL;
+			}
+			rb_tree_release_node(tree, node, free_key, free_data);
+			RB_STAT(tree, node_frees);
+			if (tree->pool == NULL)
+				free(node);
+			node = parent;
+		}
+	}
+	tree->root = RB_NIL;
+	tree->max = RB_NIL;
+	tree->count = 0;
+}
+
+
+extern void rb_tree_destroy(struct rb_tree* tree, rb_free_fn free_key, rb_free_fn free_data){
+
+	rb_tree_release(tree, free_key, free_data);
+	if (tree->pool != NULL){
+		rb_pool_chunks_free(tree->pool->node_chunks);
+		rb_pool_chunks_free(tree->pool->byte_chunks);
+		free(tree->pool);
+	}
+	free(tree);
+}
+
+
+extern bool rb_tree_stats(const struct rb_tree* tree, struct rb_stats* out){
+
+#ifdef RB_STATS
+	*out = tree->stats;
+	return true;
+#else
+	(void) tree;
+	memset(out, 0, sizeof(*out));
+	return false;
+#endif
+}
+
+
+extern void rb_tree_stats_reset(struct rb_tree* tree){
+
+#ifdef RB_STATS
+	memset(&tree->stats, 0, sizeof(tree->stats));
+#else
+	(void) tree;
+#endif
+}
+
+
+/* The augmented fields node should have, checked without trusting its own. */
+static bool rb_augment_valid(struct rb_tree* tree, struct rb_node* node){
+
+	unsigned char saved[RB_AGGREGATE_MAX];
+	struct rb_interval interval;
+	size_t size = 0;
+	bool valid = true;
+
+	if (!tree->augment)
+		return true;
+
+	/* Recompute in place from the children, compare, then put back. */
+	if (tree->augment & RB_AUGMENT_SIZE)
+		size = *rb_node_size_field(tree, node);
+	if (tree->augment & RB_AUGMENT_INTERVAL)
+		interval = *(struct rb_interval*) node->aux;
+	if (tree->augment & RB_AUGMENT_AGGREGATE)
+		memcpy(saved, rb_node_agg(tree, node), tree->aggregate.size);
+
+	rb_augment_node(tree, node);
+	if (tree->augment & RB_AUGMENT_SIZE){
+		valid = *rb_node_size_field(tree, node) == size;
+		*rb_node_size_field(tree, node) = size;
+	}
+	if (tree->augment & RB_AUGMENT_INTERVAL){
+		valid = valid && ((struct rb_interval*) node->aux)->max_hi == interval.max_hi;
+		*(struct rb_interval*) node->aux = interval;
+	}
+	if (tree->augment & RB_AUGMENT_AGGREGATE){
+		valid = valid && memcmp(saved, rb_node_agg(tree, node), tree->aggregate.size) == 0;
+		memcpy(rb_node_agg(tree, node), saved, tree->aggregate.size);
+	}
+	return valid;
+}
+
+
+extern enum rb_violation rb_tree_validate(struct rb_tree* tree){
+
+	struct rb_node* node = tree->root;
+	struct rb_node* prev = RB_NIL;
+	struct rb_node* last = NULL;	/* previous node in key order */
+	struct rb_node* next;
+	long blacks, leaf_blacks = -1;
+
+	if (rb_parent(RB_NIL) != NULL || RB_NIL->left != NULL || RB_NIL->right != NULL ||
+	    rb_color(RB_NIL) != BLACK)
+		return RB_BAD_SENTINEL;
+	if (tree->root == RB_NIL)
+		return tree->max == RB_NIL ? RB_VALID : RB_BAD_MAX;
+	if (rb_color(tree->root) != BLACK)
+		return RB_RED_ROOT;
+	if (rb_parent(tree->root) != RB_NIL)
+		return RB_BAD_PARENT;
+
+	blacks = 1;
+	while (node != RB_NIL){
+		bool in_order = false;
+
+		next = RB_NIL;
+		if (prev == rb_parent(node)){
+			/* First arrival: everything that only needs the node and its children. */
+			if ((node->left != RB_NIL && rb_parent(node->left) != node) ||
+			    (node->right != RB_NIL && rb_parent(node->right) != node))
+				return RB_BAD_PARENT;
+			if (rb_color(node) == RED &&
+			    (rb_color(node->left) == RED || rb_color(node->right) == RED))
+				return RB_RED_RED;
+			if (node->left == RB_NIL || node->right == RB_NIL){
+				if (leaf_blacks < 0)
+					leaf_blacks = blacks;
+				else if (blacks != leaf_blacks)
+					return RB_BLACK_HEIGHT;
+			}
+			if (!rb_augment_valid(tree, node))
+				return RB_BAD_AUGMENT;
+			next = node->left;
+			in_order = (next == RB_NIL);
+		}
+		else if (prev == node->left){
+			in_order = true;
+		}
+
+		if (in_order){
+			/* Left subtree done: node's turn in key order. */
+			if (last != NULL && rb_compare(tree, last->key, last->key_len, node->key, node->key_len) > 0)
+				return RB_BAD_ORDER;
+			last = node;
+			next = node->right;
+		}
+
+		prev = node;
+		if (next != RB_NIL){
+			node = next;
+			blacks += (rb_color(node) == BLACK);
+		}
+		else {
+			blacks -= (rb_color(node) == BLACK);
+			node = rb_parent(node);
+		}
+	}
+	return last == tree->max ? RB_VALID : RB_BAD_MAX;
+}
+
+
+/* Distinct cache lines a lookup reads at node: left, right, key, key_len and,
+   for keys outside the node, the key bytes. */
+static unsigned int rb_node_lines(struct rb_node* node){
+
+	uintptr_t lines[4];
+	uintptr_t first, last, line;
+	unsigned int count = 0, i, extra = 0;
+
+	lines[0] = (uintptr_t) &node->left / RB_CACHE_LINE;
+	lines[1] = (uintptr_t) &node->right / RB_CACHE_LINE;
+	lines[2] = (uintptr_t) &node->key / RB_CACHE_LINE;
+	lines[3] = ((uintptr_t) &node->key_len + sizeof(node->key_len) - 1) / RB_CACHE_LINE;
+
+	for (i = 0; i < 4; i++){
+		unsigned int j;
+		for (j = 0; j < i && lines[j] != lines[i]; j++)
+			;
+		count += (j == i);
+	}
+
+	if (!RB_KEY_INLINE(node) && node->key_len > 0){
+		first = (uintptr_t) node->key / RB_CACHE_LINE;
+		last = ((uintptr_t) node->key + node->key_len - 1) / RB_CACHE_LINE;
+		for (line = first; line <= last; line++){
+			for (i = 0; i < 4 && lines[i] != line; i++)
+				;
+			extra += (i == 4);
+		}
+	}
+	return count + extra;
+}
+
+
+extern void rb_tree_profile(struct rb_tree* tree, struct rb_profile* out){
+
+	/* Path cost in lines, by depth; the height is at most 2 log2(n + 1). */
+	double path_lines[RB_PROFILE_MAX_DEPTH + 1];
+	double depth_sum = 0, line_sum = 0;
+	struct rb_node* node = tree->root;
+	struct rb_node* prev = RB_NIL;
+	struct rb_node* next;
+	unsigned int depth = 1;
+
+	memset(out, 0, sizeof(*out));
+	path_lines[0] = 0;
+
+	for (next = tree->root; next != RB_NIL; next = next->left)
+		out->black_height += (rb_color(next) == BLACK);
+
+	/* Pre-order walk on parent pointers: prev tells whether node was
+	   reached from above, from its left child or from its right child. */
+	while (node != RB_NIL){
+		if (prev == rb_parent(node)){
+			out->nodes++;
+			if (depth > out->height)
+				out->height = depth;
+			if (depth <= RB_PROFILE_MAX_DEPTH){
+				out->depth_histogram[depth - 1]++;
+				path_lines[depth] = path_lines[depth - 1] + rb_node_lines(node);
+				line_sum += path_lines[depth];
+			}
+			depth_sum += depth;
+			if (!RB_KEY_INLINE(node))
+				out->key_bytes += node->key_len;
+
+			next = (node->left != RB_NIL) ? node->left : node->right;
+		}
+		else if (prev == node->left){
+			next = node->right;
+		}
+		else {
+			next = RB_NIL;
+		}
+
+		prev = node;
+		if (next != RB_NIL){
+			node = next;
+			depth++;
+		}
+		else {
+			node = rb_parent(node);
+			depth--;
+		}
+	}
+
+	out->node_bytes = out->nodes * tree->node_size;
+	if (out->nodes > 0){
+		out->average_depth = depth_sum / out->nodes;
+		out->cache_lines_per_lookup = line_sum / out->nodes;
+	}
+}
+
+
+extern void rb_tree_clear(struct rb_tree* tree, rb_free_fn free_key, rb_free_fn free_data){
+
+	rb_tree_release(tree, free_key, free_data);
+	if (tree->pool != NULL){
+		rb_pool_chunks_reset(&tree->pool->node_chunks);
+		rb_pool_chunks_reset(&tree->pool->byte_chunks);
+		tree->pool->free_list = NULL;
+	}
+}
+
+
+/*
+      |                   |
+      x                   y
+     / \     ====>       / \
+    a   y               x   c 
+       / \             / \
+      b   c           a   b
+      
+      node: x
+*/
+void left_rotate(struct rb_tree *tree, struct rb_node *x){
+
+	struct rb_node *y = x->right;
+
+	RB_STAT(tree, left_rotations);
+	x->right = y->left;
+
+	if ( y->left != RB_NIL ){
+		rb_set_parent(y->left, x);
+	}
+	rb_set_parent(y, rb_parent(x));
+
+	if ( rb_parent(x) == RB_NIL ){
+		tree->root = y;
+	
+	}
+	else if(x == rb_parent(x)->left){
+
+		rb_parent(x)->left = y;
+	}
+	else{
+		rb_parent(x)->right = y;
+	}
+	y->left = x;
+	rb_set_parent(x, y);
+
+	if (tree->augment){
+		rb_augment_node(tree, x);
+		rb_augment_node(tree, y);
+	}
+}
+
+
+/*
+        |                   |
+        y                   x
+       / \   ======>       / \
+      x   c               a   y
+     / \                     / \
+    a   b                   b   c
+
+*/
+void right_rotate( struct rb_tree *tree, struct rb_node *y){
+
+	struct rb_node *x =  y->left;
+
+	RB_STAT(tree, right_rotations);
+	y->left = x->right;
+
+	if ( x->right != RB_NIL ){
+		rb_set_parent(x->right, y);
+	}
+	rb_set_parent(x, rb_parent(y));
+
+	if ( rb_parent(y) == RB_NIL ){  /* Y is ROOT */
+		tree->root = x;
+	}
+	else if (y == rb_parent(y)->left){ /* Y is a LEFT child */
+		rb_parent(y)->left = x;
+	}
+	else{
+		rb_parent(y)->right = x; /* Y is RIGHT child */
+	}
+	x->right = y;
+	rb_set_parent(y, x);
+
+	if (tree->augment){
+		rb_augment_node(tree, y);
+		rb_augment_node(tree, x);
+	}
+}
+
+
+/* Hangs node off parent (RB_NIL for an empty tree) on the side given by cmp,
+   the result of comparing node's key with parent's, and rebalances. */
+static void rb_link_node(struct rb_tree *tree, struct rb_node *parent, struct rb_node *node, int cmp){
+
+	/* A bare node has nowhere to keep the tree's aux fields. */
+	if (rb_bare(node) && tree->node_size != sizeof(struct rb_node))
+		return;
+
+	rb_set_parent(node, parent);
+	if (parent == tree->max && (parent == RB_NIL || cmp >= 0))
+		tree->max = node;
+	tree->count++;
+
+	if (parent == RB_NIL){
+		tree->root = node;
+	}
+	else if (cmp < 0){
+		parent->left = node;  
+	}
+	else {
+		parent->right = node;
+	}
+
+	node->left = RB_NIL;
+	node->right = RB_NIL;
+	rb_set_color(node, RED);
+	rb_augment_path(tree, node);
+	rb_insert_fixup(tree, node);
+}
+
+
+extern void rb_insert(struct rb_tree *tree, struct rb_node *node){
+
+	struct rb_node *y = RB_NIL;
+	struct rb_node *x = tree->root;
+	int cmp = 0;
+	
+	/*traverse down the tree to find the insertion point*/
+	while (x != RB_NIL){
+		y = x;
+		cmp = rb_compare(tree, node->key, node->key_len, x->key, x->key_len);
+		x = (cmp < 0) ? x->left : x->right;
+	}
+
+	/*the last comparison on the way down decides the side*/
+	rb_link_node(tree, y, node, cmp);
+}
+
+
+/* Finds where key is, or would be linked, starting from finger: climbs while
+   the finger's subtree can not hold key, then descends. Returns the node holding
+   key (*cmp == 0) or the leaf parent to link it under, on the side of *cmp. */
+static struct rb_node* rb_finger_locate(struct rb_tree *tree, struct rb_node *finger,
+					const void *key, size_t key_len, int *cmp){
+
+	struct rb_node *x = finger;
+	struct rb_node *p;
+	int c, m;
+
+	if (x == NULL || x == RB_NIL){
+		x = tree->root;
+	}
+	else {
+		c = rb_compare(tree, key, key_len, x->key, x->key_len);
+		/* At or past the maximum, which never has a right child. Checked for
+		   any hint below the key, so appends skip the climb wherever the
+		   hint sits. */
+		if (c > 0 && x != tree->max){
+			m = rb_compare(tree, key, key_len, tree->max->key, tree->max->key_len);
+			if (m >= 0){
+				x = tree->max;
+				c = m;
+			}
+		}
+		if (c >= 0 && x == tree->max){
+			*cmp = c;
+			return x;
+		}
+		/* Climbing from the side the key is on tells nothing; the first
+		   ancestor reached from the other side bounds x's subtree. */
+		while (c != 0 && (p = rb_parent(x)) != RB_NIL){
+			if (x == (c > 0 ? p->right : p->left)){
+				x = p;
+				continue;
+			}
+			c = rb_compare(tree, key, key_len, p->key, p->key_len);
+			if (c != 0 && (c > 0) != (x == p->left))
+				break;
+			x = p;
+		}
+	}
+
+	*cmp = 0;
+	p = RB_NIL;
+	while (x != RB_NIL){
+		p = x;
+		*cmp = rb_compare(tree, key, key_len, x->key, x->key_len);
+		if (*cmp == 0)
+			break;
+		x = (*cmp < 0) ? x->left : x->right;
+	}
+	return p;
+}
+
+
+extern void rb_insert_hint(struct rb_tree *tree, struct rb_node *hint, struct rb_node *node){
+
+	int cmp;
+	struct rb_node *parent = rb_finger_locate(tree, hint, node->key, node->key_len, &cmp);
+
+	/* Equal keys go right, as in rb_insert: under the successor if needed. */
+	if (cmp == 0 && parent != RB_NIL && parent->right != RB_NIL){
+		parent = parent->right;
+		while (parent->left != RB_NIL)
+			parent = parent->left;
+		cmp = -1;
+	}
+	rb_link_node(tree, parent, node, cmp);
+}
+
+
+extern struct rb_node* rb_finger_search(struct rb_tree *tree, struct rb_node *finger, const void *key, size_t key_len){
+
+	int cmp;
+	struct rb_node *node = rb_finger_locate(tree, finger, key, key_len, &cmp);
+
+	return (node != RB_NIL && cmp == 0) ? node : NULL;
+}
+
+
+extern struct rb_node* rb_upsert(struct rb_tree *tree, const void *key, size_t key_len, bool *inserted){
+
+	struct rb_node *y = RB_NIL;
+	struct rb_node *x = tree->root;
+	struct rb_node *node;
+	int cmp = 0;
+
+	while (x != RB_NIL){
+		cmp = rb_compare(tree, key, key_len, x->key, x->key_len);
+		if (cmp == 0){
+			if (inserted != NULL)
+				*inserted = false;
+			return x;
+		}
+		y = x;
+		x = (cmp < 0) ? x->left : x->right;
+	}
+
+	node = rb_tree_node_alloc(tree, key, key_len, NULL);
+	rb_link_node(tree, y, node, cmp);
+	if (inserted != NULL)
+		*inserted = true;
+	return node;
+}
+
+
+void rb_insert_fixup(struct rb_tree* tree, struct rb_node* node){
+
+	struct rb_node* y;
+
+	while (rb_color(rb_parent(node)) == RED){
+		if (rb_parent(node) == rb_parent(rb_parent(node))->left){
+			y = rb_parent(rb_parent(node))->right;
+			/*case 1: node's uncle y is red*/
+			if (rb_color(y) == RED) {  
+				RB_STAT(tree, insert_case1);
+				rb_set_color(rb_parent(node), BLACK);
+				rb_set_color(y, BLACK);
+				rb_set_color(rb_parent(rb_parent(node)), RED);
+				 /* Check if nodes grand parent needs fixup*/
+				node = rb_parent(rb_parent(node));
+			}
+			/*case 2: node's uncle y is black and node is a right child*/
+			else{
+			  if (node == rb_parent(node)->right){
+				/*left rotate parent*/
+				RB_STAT(tree, insert_case2);
+				node = rb_parent(node);
+				left_rotate(tree, node);
+			  }
+
+			/*case 3: node's uncle y is black and node is a left child*/
+			RB_STAT(tree, insert_case3);
+			rb_set_color(rb_parent(node), BLACK);
+			rb_set_color(rb_parent(rb_parent(node)), RED);
+			right_rotate(tree, rb_parent(rb_parent(node)));
+			}
+					
+		}
+		else {
+			/*symmetric case of above except that node's parent is the right child of GP.*/
+			y = rb_parent(rb_parent(node))->left;
+			/*case 1*/
+			if (rb_color(y) == RED){
+				RB_STAT(tree, insert_case1);
+				rb_set_color(rb_parent(node), BLACK);
+				rb_set_color(y, BLACK);
+				rb_set_color(rb_parent(rb_parent(node)), RED);
+				node = rb_parent(rb_parent(node));
+			}/*case 2*/
+			else {
+			  if (node == rb_parent(node)->left){
+				RB_STAT(tree, insert_case2);
+				node = rb_parent(node);
+				right_rotate(tree, node);
+			  }
+			/*case 3*/
+			  RB_STAT(tree, insert_case3);
+			  rb_set_color(rb_parent(node), BLACK);
+			  rb_set_color(rb_parent(rb_parent(node)), RED);
+			  left_rotate(tree, rb_parent(rb_parent(node)));
+			}
+		}
+		
+	}
+
+	rb_set_color(tree->root, BLACK);
+}
+
+
+
+void rb_transplant(struct rb_tree* tree, struct rb_node* u, struct rb_node* v){
+
+	if (rb_parent(u) == RB_NIL){
+		tree->root = v;
+	}
+	else if(u == rb_parent(u)->left){
+		rb_parent(u)->left = v;
+	}
+	else {
+		rb_parent(u)->right = v;
+	}
+	if (v != RB_NIL)
+		rb_set_parent(v, rb_parent(u));
+}
+
+
+extern struct rb_node* rb_delete(struct rb_tree* tree, struct rb_node* node){
+
+	struct rb_node* x;
+	struct rb_node* x_parent = rb_parent(node);	/* where x ends up; x may be RB_NIL */
+	struct rb_node* y = node;
+	struct rb_node* changed = rb_parent(node);	/* lowest node whose subtree lost a node */
+	unsigned int y_original_color = rb_color(y);
+
+	if (node == tree->max)
+		tree->max = tree_predecessor(node);
+	tree->count--;
+
+	if (node->left == RB_NIL){
+		x = node->right;
+		rb_transplant(tree, node, node->right);
+	}
+	else if(node->right == RB_NIL){
+		x = node->left;
+		rb_transplant(tree, node, node->left);
+	}
+	else { /* node has two children that are not sentinel*/
+		
+		y = tree_minimum(node->right);
+		y_original_color = rb_color(y);
+		x = y->right;
+
+		/*simple case where the tree minimum is node's right child*/
+		if (rb_parent(y) == node){
+			if (x != RB_NIL)
+				rb_set_parent(x, y);
+			changed = y;
+			x_parent = y;
+		}
+		else {
+			changed = x_parent = rb_parent(y);  /* make tree minimum the replacement for node 
+			   and its right subtree is nodes right subtree
+			   with tree minimum spliced out and tree minimums right subtree
+			   is replacement node's rights left subtree. 
+			*/
+			rb_transplant(tree, y, y->right);
+			y->right = node->right;
+			rb_set_parent(y->right, y);
+		}
+		/*tree minimum is node's right child*/
+		rb_transplant(tree, node, y);
+		y->left = node->left;
+		rb_set_parent(y->left, y);
+		rb_set_color(y, rb_color(node));
+	}
+	rb_augment_path(tree, changed);
+	if (y_original_color == BLACK){
+		rb_delete_rebalance(tree, x, x_parent);
+	}
+
+	return x;
+}
+
+
+/* node, possibly RB_NIL, carries the extra black; parent is passed explicitly
+   because the sentinel's parent link is never written. */
+static void rb_delete_rebalance(struct rb_tree *tree, struct rb_node *node, struct rb_node *parent){
+
+	struct rb_node *w;
+
+	while (node != tree->root && rb_color(node) == BLACK){
+		RB_STAT(tree, delete_fixup_iterations);
+		if (node == parent->left){
+			w = parent->right;
+			/*case 1: node's sibling w is red. Switch colors of parent
+			 and sibling and perform left rotation on the parent.*/
+			if (rb_color(w) == RED){
+				rb_set_color(w, BLACK);
+				rb_set_color(parent, RED);
+				left_rotate(tree, parent);
+				w = parent->right;
+			}
+			/*case 2: node's sibling is black and both of siblings children are black
+			  Mark the sibling red and the new node is now the parent.
+			 */
+			
+			if (rb_color(w->left) == BLACK && rb_color(w->right) == BLACK){
+				rb_set_color(w, RED);
+				node = parent;
+				parent = rb_parent(node);
+			}
+			/*case 3: node's sibling is black. Siblings left child is red, 
+			  and right child is black. Switch colors of sibling and its left child
+			  and perform right rotate on sibling.*/
+			else {
+			  if (rb_color(w->right) == BLACK){
+				rb_set_color(w->left, BLACK);
+				rb_set_color(w, RED);
+				right_rotate(tree, w);
+				w = parent->right;
+			  }
+			/*case 4: sibling is black and its right child is red.
+			  Make siblings right black and nodes paren't black.
+			  Sibling gets the same color as parent. Perform left rotate on parent.
+			 */
+			  rb_set_color(w, rb_color(parent));
+			  rb_set_color(parent, BLACK);
+			  rb_set_color(w->right, BLACK);
+			  left_rotate(tree, parent);
+			  node = tree->root;
+			}
+		}
+		else {
+			/*Symmetric case where node is parent's right child.*/
+			w = parent->left;
+			if (rb_color(w) == RED){
+				rb_set_color(w, BLACK);
+				rb_set_color(parent, RED);
+				right_rotate(tree, parent);
+				w = parent->left;
+			}
+			if (rb_color(w->left) == BLACK && rb_color(w->right) == BLACK){
+				rb_set_color(w, RED);
+				node = parent;
+				parent = rb_parent(node);
+			}
+			else {
+			  if (rb_color(w->left) == BLACK){
+				rb_set_color(w->right, BLACK);
+				rb_set_color(w, RED);
+				left_rotate(tree, w);
+				w = parent->left;
+			  }
+
+			rb_set_color(w, rb_color(parent));
+			rb_set_color(parent, BLACK);
+			rb_set_color(w->left, BLACK);
+			right_rotate(tree, parent);
+			node = tree->root;
+			}
+		}
+	}
+	if (node != RB_NIL)
+		rb_set_color(node, BLACK);
+}
+
+
+void rb_delete_fixup(struct rb_tree *tree, struct rb_node *node){
+
+	rb_delete_rebalance(tree, node, rb_parent(node));
+}
+
+
+extern bool rb_delete_key(struct rb_tree* tree, const void* key, size_t key_len){
+
+	struct rb_node* node = tree->root;
+	int cmp;
+
+	while (node != RB_NIL){
+		cmp = rb_compare(tree, key, key_len, node->key, node->key_len);
+		if (cmp == 0){
+			rb_delete(tree, node);
+			rb_tree_free_node(tree, node);
+			return true;
+		}
+		node = (cmp < 0) ? node->left : node->right;
+	}
+
+	return false;
+}
+
+
+extern struct rb_node* rb_search(struct rb_tree* tree, char* key){
+
+	return rb_find(tree, key, rb_key_len(tree, key));
+}
+
+
+extern struct rb_node* rb_lower_bound(struct rb_tree* tree, const void* key, size_t key_len){
+
+	struct rb_node* node = tree->root;
+	struct rb_node* bound = NULL;
+
+	while (node != RB_NIL){
+		if (rb_compare(tree, node->key, node->key_len, key, key_len) >= 0){
+			bound = node;
+			node = node->left;
+		}
+		else {
+			node = node->right;
+		}
+	}
+	return bound;
+}
+
+
+extern struct rb_node* rb_upper_bound(struct rb_tree* tree, const void* key, size_t key_len){
+
+	struct rb_node* node = tree->root;
+	struct rb_node* bound = NULL;
+
+	while (node != RB_NIL){
+		if (rb_compare(tree, node->key, node->key_len, key, key_len) > 0){
+			bound = node;
+			node = node->left;
+		}
+		else {
+			node = node->right;
+		}
+	}
+	return bound;
+}
+
+
+extern struct rb_node* rb_floor(struct rb_tree* tree, const void* key, size_t key_len){
+
+	struct rb_node* node = tree->root;
+	struct rb_node* bound = NULL;
+
+	while (node != RB_NIL){
+		if (rb_compare(tree, node->key, node->key_len, key, key_len) <= 0){
+			bound = node;
+			node = node->right;
+		}
+		else {
+			node = node->left;
+		}
+	}
+	return bound;
+}
+
+
+extern struct rb_node* rb_ceiling(struct rb_tree* tree, const void* key, size_t key_len){
+
+	return rb_lower_bound(tree, key, key_len);
+}
+
+
+extern size_t rb_range(struct rb_tree* tree, const void* lo, size_t lo_len, const void* hi, size_t hi_len,
+		       rb_visit_fn visit, void* ctx){
+
+	struct rb_node* node = rb_lower_bound(tree, lo, lo_len);
+	size_t visited = 0;
+
+	while (node != NULL && node != RB_NIL &&
+	       rb_compare(tree, node->key, node->key_len, hi, hi_len) <= 0){
+		visited++;
+		if (!visit(node, ctx))
+			break;
+		node = tree_successor(node);
+	}
+	return visited;
+}
+
+
+static struct rb_node* rb_iter_descend(struct rb_iter* iter, struct rb_node* node, bool to_left){
+
+	while (node != RB_NIL){
+		iter->path[iter->depth++] = node;
+		node = to_left ? node->left : node->right;
+	}
+	return iter->depth ? iter->path[iter->depth - 1] : NULL;
+}
+
+
+extern struct rb_node* rb_iter_first(struct rb_iter* iter, struct rb_tree* tree){
+
+	iter->depth = 0;
+	return rb_iter_descend(iter, tree->root, true);
+}
+
+
+extern struct rb_node* rb_iter_last(struct rb_iter* iter, struct rb_tree* tree){
+
+	iter->depth = 0;
+	return rb_iter_descend(iter, tree->root, false);
+}
+
+
+extern struct rb_node* rb_iter_seek(struct rb_iter* iter, struct rb_tree* tree, const void* key, size_t key_len){
+
+	struct rb_node* node = tree->root;
+	int bound_depth = 0;
+
+	/* The path to the lower bound is the descent's prefix up to the last
+	   node that was >= key. */
+	iter->depth = 0;
+	while (node != RB_NIL){
+		iter->path[iter->depth++] = node;
+		if (rb_compare(tree, node->key, node->key_len, key, key_len) >= 0){
+			bound_depth = iter->depth;
+			node = node->left;
+		}
+		else {
+			node = node->right;
+		}
+	}
+	iter->depth = bound_depth;
+	return iter->depth ? iter->path[iter->depth - 1] : NULL;
+}
+
+
+extern struct rb_node* rb_select(struct rb_tree* tree, size_t k){
+
+	struct rb_node* node = tree->root;
+
+	while (node != RB_NIL){
+		size_t left = rb_node_size(tree, node->left);
+
+		if (k < left){
+			node = node->left;
+		}
+		else if (k == left){
+			return node;
+		}
+		else {
+			k -= left + 1;
+			node = node->right;
+		}
+	}
+	return NULL;
+}
+
+
+/* Number of keys < key, or <= key when inclusive. */
+static size_t rb_rank_of(struct rb_tree* tree, const void* key, size_t key_len, bool inclusive){
+
+	struct rb_node* node = tree->root;
+	size_t rank = 0;
+	int cmp;
+
+	while (node != RB_NIL){
+		cmp = rb_compare(tree, node->key, node->key_len, key, key_len);
+		if (cmp < 0 || (inclusive && cmp == 0)){
+			rank += rb_node_size(tree, node->left) + 1;
+			node = node->right;
+		}
+		else {
+			node = node->left;
+		}
+	}
+	return rank;
+}
+
+
+extern size_t rb_rank(struct rb_tree* tree, const void* key, size_t key_len){
+
+	return rb_rank_of(tree, key, key_len, false);
+}
+
+
+extern size_t rb_count_range(struct rb_tree* tree, const void* lo, size_t lo_len, const void* hi, size_t hi_len){
+
+	size_t below_lo = rb_rank_of(tree, lo, lo_len, false);
+	size_t upto_hi = rb_rank_of(tree, hi, hi_len, true);
+
+	return (upto_hi > below_lo) ? upto_hi - below_lo : 0;
+}
+
+
+extern size_t rb_tree_size(struct rb_tree* tree){
+
+	return tree->count;
+}
+
+
+extern struct rb_interval* rb_node_interval(struct rb_node* node){
+
+	return (struct rb_interval*) node->aux;
+}
+
+
+extern struct rb_node* rb_interval_insert(struct rb_tree* tree, int64_t lo, int64_t hi, char* data){
+
+	struct rb_node* node = rb_tree_node_alloc(tree, &lo, sizeof(lo), data);
+
+	rb_node_interval(node)->hi = hi;
+	rb_node_interval(node)->max_hi = hi;
+	rb_insert(tree, node);
+	return node;
+}
+
+
+/* In-order walk that skips any subtree whose max_hi ends before lo, and
+   stops at the first node that starts after hi. */
+extern size_t rb_interval_overlaps(struct rb_tree* tree, int64_t lo, int64_t hi, rb_visit_fn visit, void* ctx){
+
+	struct rb_node* stack[RB_ITER_MAX_DEPTH];
+	struct rb_node* node = tree->root;
+	size_t visited = 0;
+	int depth = 0;
+	int64_t node_lo;
+
+	for (;;){
+		while (node != RB_NIL && rb_node_interval(node)->max_hi >= lo){
+			stack[depth++] = node;
+			node = node->left;
+		}
+		if (depth == 0)
+			break;
+		node = stack[--depth];
+
+		memcpy(&node_lo, node->key, sizeof(node_lo));
+		if (node_lo > hi)
+			break;
+		if (rb_node_interval(node)->hi >= lo){
+			visited++;
+			if (!visit(node, ctx))
+				break;
+		}
+		node = node->right;
 	}
-	return sentinel;
+	return visited;
 }
 
 
-extern struct rb_tree *rb_tree_alloc(){
+extern void* rb_node_aggregate(struct rb_tree* tree, struct rb_node* node){
 
-	struct rb_tree* tree;
-	tree = (struct rb_tree*) malloc(sizeof(struct rb_tree));
-	memset(tree, 0, sizeof(tree));
-	tree->root = SENTINEL();
-	return tree;
+	return rb_node_agg(tree, node);
 }
 
 
-/*
-      |                   |
-      x                   y
-     / \     ====>       / \
-    a   y               x   c 
-       / \             / \
-      b   c           a   b
-      
-      node: x
-*/
-void left_rotate(struct rb_tree *tree, struct rb_node *x){
+extern void rb_aggregate_refresh(struct rb_tree* tree, struct rb_node* node){
 
-	struct rb_node *y = x->right;
-	x->right = y->left;
+	rb_augment_path(tree, node);
+}
 
-	if ( y->left != SENTINEL() ){
-		y->left->parent = x;
-	}
-	y->parent = x->parent;
 
-	if ( x->parent == SENTINEL() ){
-		tree->root = y;
-	
+/*
+   Finds the highest node inside [lo, hi], then sums its left subtree's keys >= lo
+   and its right subtree's keys <= hi. On the left side each node >= lo brings
+   itself and its whole right subtree, prepended to what was collected below it;
+   the right side mirrors that. Both walks are single descents.
+*/
+extern void rb_aggregate_range(struct rb_tree* tree, const void* lo, size_t lo_len,
+			       const void* hi, size_t hi_len, void* out){
+
+	uint64_t left[RB_AGGREGATE_MAX / sizeof(uint64_t)];
+	uint64_t right[RB_AGGREGATE_MAX / sizeof(uint64_t)];
+	uint64_t value[RB_AGGREGATE_MAX / sizeof(uint64_t)];
+	struct rb_node* split = tree->root;
+	struct rb_node* node;
+
+	while (split != RB_NIL){
+		if (rb_compare(tree, split->key, split->key_len, lo, lo_len) < 0)
+			split = split->right;
+		else if (rb_compare(tree, split->key, split->key_len, hi, hi_len) > 0)
+			split = split->left;
+		else
+			break;
+	}
+	if (split == RB_NIL){
+		tree->aggregate.identity(out);
+		return;
 	}
-	else if(x == x->parent->left){
 
-		x->parent->left = y;
+	tree->aggregate.identity(left);
+	for (node = split->left; node != RB_NIL; ){
+		if (rb_compare(tree, node->key, node->key_len, lo, lo_len) >= 0){
+			if (node->right != RB_NIL)
+				rb_agg_prepend(tree, left, rb_node_agg(tree, node->right));
+			tree->aggregate.value(value, node);
+			rb_agg_prepend(tree, left, value);
+			node = node->left;
+		}
+		else {
+			node = node->right;
+		}
 	}
-	else{
-		x->parent->right = y;
+
+	tree->aggregate.identity(right);
+	for (node = split->right; node != RB_NIL; ){
+		if (rb_compare(tree, node->key, node->key_len, hi, hi_len) <= 0){
+			if (node->left != RB_NIL)
+				rb_agg_append(tree, right, rb_node_agg(tree, node->left));
+			tree->aggregate.value(value, node);
+			rb_agg_append(tree, right, value);
+			node = node->right;
+		}
+		else {
+			node = node->left;
+		}
 	}
-	y->left = x;
-	x->parent = y;
+
+	tree->aggregate.value(value, split);
+	rb_agg_append(tree, left, value);
+	rb_agg_append(tree, left, right);
+	memcpy(out, left, tree->aggregate.size);
 }
 
 
-/*
-        |                   |
-        y                   x
-       / \   ======>       / \
-      x   c               a   y
-     / \                     / \
-    a   b                   b   c
+/* Steps to the in-order neighbour on the given side: the extreme node of that
+   subtree, or else the nearest ancestor reached from the other side. */
+static struct rb_node* rb_iter_step(struct rb_iter* iter, bool forward){
 
-*/
-void right_rotate( struct rb_tree *tree, struct rb_node *y){
+	struct rb_node* node;
+	struct rb_node* child;
 
-	struct rb_node *x =  y->left;
-	y->left = x->right;
+	if (iter->depth == 0)
+		return NULL;
 
-	if ( x->right != SENTINEL() ){
-		x->right->parent = y;
-	}
-	x->parent = y->parent;
+	node = iter->path[iter->depth - 1];
+	child = forward ? node->right : node->left;
+	if (child != RB_NIL)
+		return rb_iter_descend(iter, child, forward);
 
-	if ( y->parent == SENTINEL() ){  /* Y is ROOT */
-		tree->root = x;
-	}
-	else if (y == y->parent->left){ /* Y is a LEFT child */
-		y->parent->left = x;
-	}
-	else{
-		y->parent->right = x; /* Y is RIGHT child */
-	}
-	x->right = y;
-	y->parent = x;
-	
+	do {
+		child = iter->path[--iter->depth];
+	} while (iter->depth > 0 &&
+		 (forward ? iter->path[iter->depth - 1]->right : iter->path[iter->depth - 1]->left) == child);
+
+	return iter->depth ? iter->path[iter->depth - 1] : NULL;
 }
 
 
-extern void rb_insert(struct rb_tree *tree, struct rb_node *node){
+extern struct rb_node* rb_iter_next(struct rb_iter* iter){
 
-	struct rb_node *y = SENTINEL();
-	struct rb_node *x = tree->root;
-	
-	/*traverse down the tree to find the insertion point*/
-	while (x != SENTINEL()){
-		y = x;
-		x = (LESS_THAN(node->key, x->key, STRING_LESS_THAN)) ? x->left : x->right;
-	}
-	node->parent = y;
+	return rb_iter_step(iter, true);
+}
 
-	/*Determine where to place the node relative to parent*/
-	if (y == SENTINEL()){
-		tree->root = node;
-	}
-	else if (LESS_THAN(node->key, y->key, STRING_LESS_THAN)){
-		y->left = node;  
-	}
-	else {
-		y->right = node;
-	}
 
-	node->left = SENTINEL();
-	node->right = SENTINEL();
-	node->color = RED;
-	rb_insert_fixup(tree, node);
+extern struct rb_node* rb_iter_prev(struct rb_iter* iter){
+
+	return rb_iter_step(iter, false);
 }
 
 
-void rb_insert_fixup(struct rb_tree* tree, struct rb_node* node){
+struct rb_batch_lane{
+	struct rb_node* node;
+	const void* key;
+	size_t key_len;
+	size_t index;
+	bool key_ready;
+};
 
-	struct rb_node* y;
 
-	while (node->parent->color == RED){
-		if (node->parent == node->parent->parent->left){
-			y = node->parent->parent->right;
-			/*case 1: node's uncle y is red*/
-			if (y->color == RED) {  
-				node->parent->color = BLACK;
-				y->color = BLACK;
-				node->parent->parent->color = RED;
-				 /* Check if nodes grand parent needs fixup*/
-				node = node->parent->parent;
+static void rb_batch_lane_start(struct rb_tree* tree, struct rb_batch_lane* lane, const void* const* keys,
+				const size_t* key_lens, size_t index){
+
+	lane->node = tree->root;
+	lane->key = keys[index];
+	lane->key_len = (key_lens != NULL) ? key_lens[index] : rb_key_len(tree, keys[index]);
+	lane->index = index;
+	lane->key_ready = false;
+}
+
+
+/*
+   Runs up to RB_BATCH_WIDTH descents in lock-step. Each step of a lane prefetches
+   the child it moves to and then yields to the other lanes, so the child's cache
+   misses overlap with their work instead of stalling this lane. A node whose key
+   is not stored inline costs one more round: its key is prefetched first and
+   compared on the lane's next turn.
+*/
+extern void rb_search_batch(struct rb_tree* tree, const void* const* keys, const size_t* key_lens,
+			    size_t n, struct rb_node** out){
+
+	struct rb_batch_lane lanes[RB_BATCH_WIDTH];
+	struct rb_batch_lane* lane;
+	struct rb_node* node;
+	size_t next = 0, active = 0, i;
+	int cmp;
+
+	while (active < RB_BATCH_WIDTH && next < n){
+		rb_batch_lane_start(tree, &lanes[active++], keys, key_lens, next++);
+	}
+
+	while (active > 0){
+		for (i = 0; i < active; ){
+			lane = &lanes[i];
+			node = lane->node;
+
+			if (node != RB_NIL){
+				if (!lane->key_ready && !RB_KEY_INLINE(node)){
+					RB_PREFETCH(node->key);
+					lane->key_ready = true;
+					i++;
+					continue;
+				}
+				cmp = rb_compare(tree, lane->key, lane->key_len, node->key, node->key_len);
+				if (cmp != 0){
+					node = (cmp < 0) ? node->left : node->right;
+					RB_PREFETCH(node);
+					RB_PREFETCH((char*) node + sizeof(struct rb_node) - 1);
+					lane->node = node;
+					lane->key_ready = false;
+					i++;
+					continue;
+				}
 			}
-			/*case 2: node's uncle y is black and node is a right child*/
-			else{
-			  if (node == node->parent->right){
-				/*left rotate parent*/
-				node = node->parent;
-				left_rotate(tree, node);
-			  }
 
-			/*case 3: node's uncle y is black and node is a left child*/
-			node->parent->color = BLACK;
-			node->parent->parent->color = RED;
-			right_rotate(tree, node->parent->parent);
+			/* Lane finished: record the result and reuse it for the next key. */
+			out[lane->index] = (node == RB_NIL) ? NULL : node;
+			if (next < n){
+				rb_batch_lane_start(tree, lane, keys, key_lens, next++);
+				i++;
 			}
-					
-		}
-		else {
-			/*symmetric case of above except that node's parent is the right child of GP.*/
-			y = node->parent->parent->left;
-			/*case 1*/
-			if (y->color == RED){
-				node->parent->color = BLACK;
-				y->color = BLACK;
-				node->parent->parent->color = RED;
-				node = node->parent->parent;
-			}/*case 2*/
 			else {
-			  if (node == node->parent->left){
-				node = node->parent;
-				right_rotate(tree, node);
-			  }
-			/*case 3*/
-			  node->parent->color = BLACK;
-			  node->parent->parent->color = RED;
-			  left_rotate(tree, node->parent->parent);
+				*lane = lanes[--active];
 			}
 		}
-		
 	}
-
-	tree->root->color = BLACK;
 }
 
 
+extern size_t rb_key_len(struct rb_tree* tree, const void* key){
 
-void rb_transplant(struct rb_tree* tree, struct rb_node* u, struct rb_node* v){
-
-	if (u->parent == SENTINEL()){
-		tree->root = v;
-	}
-	else if(u == u->parent->left){
-		u->parent->left = v;
-	}
-	else {
-		u->parent->right = v;
-	}
-	v->parent = u->parent;
+	return tree->key_size ? tree->key_size : strlen(key);
 }
 
 
-extern struct rb_node* rb_delete(struct rb_tree* tree, struct rb_node* node){
-
-	struct rb_node* x;
-	struct rb_node* y = node;
-	unsigned int y_original_color = y->color;
+extern struct rb_node* rb_find(struct rb_tree* tree, const void* key, size_t key_len){
 
-	if (node->left == SENTINEL()){
-		x = node->right;
-		rb_transplant(tree, node, node->right);
-	}
-	else if(node->right == SENTINEL()){
-		x = node->left;
-		rb_transplant(tree, node, node->left);
-	}
-	else { /* node has two children that are not sentinel*/
-		
-		y = tree_minimum(node->right);
-		y_original_color = y->color;
-		x = y->right;
+	struct rb_node* node = tree->root;
+	int cmp;
 
-		/*simple case where the tree minimum is node's right child*/
-		if (y->parent == node){
-			x->parent = y;
-		}
-		else {  /* make tree minimum the replacement for node 
-			   and its right subtree is nodes right subtree
-			   with tree minimum spliced out and tree minimums right subtree
-			   is replacement node's rights left subtree. 
-			*/
-			rb_transplant(tree, y, y->right);
-			y->right = node->right;
-			y->right->parent = y;
-		}
-		/*tree minimum is node's right child*/
-		rb_transplant(tree, node, y);
-		y->left = node->left;
-		y->left->parent = y;
-		y->color = node->color;
-	}
-	if (y_original_color == BLACK && x != SENTINEL()){
-		rb_delete_fixup(tree, x);
+	while (node != RB_NIL){
+		cmp = rb_compare(tree, key, key_len, node->key, node->key_len);
+		if (cmp == 0)
+			return node;
+		node = (cmp < 0) ? node->left : node->right;
 	}
 
-	return x;
+	return NULL;
 }
 
 
-void rb_delete_fixup(struct rb_tree *tree, struct rb_node *node){
+static struct rb_node* rb_build_sorted(struct rb_tree* tree, char** keys, char** values,
+				       size_t lo, size_t hi, size_t depth, size_t red_depth){
 
-	struct rb_node *x, *w;
+	struct rb_node* node;
+	size_t mid;
 
-	while (node != tree->root && node->color == BLACK){
-		if (node == node->parent->left){
-			w = node->parent->right;
-			/*case 1: node's sibling w is red. Switch colors of parent
-			 and sibling and perform left rotation on the parent.*/
-			if (w->color == RED){
-				w->color = BLACK;
-				node->parent->color = RED;
-				left_rotate(tree, node->parent);
-				w = node->parent->right;
-			}
-			/*case 2: node's sibling is black and both of siblings children are black
-			  Mark the sibling red and the new node is now the parent.
-			 */
-			
-			if (w->left->color == BLACK && w->right->color == BLACK){
-				w->color = RED;
-				node = node->parent;
-			}
-			/*case 3: node's sibling is black. Siblings left child is red, 
-			  and right child is black. Switch colors of sibling and its left child
-			  and perform right rotate on sibling.*/
-			else {
-			  if (w->right->color == BLACK){
-				w->left->color = BLACK;
-				w->color = RED;
-				right_rotate(tree, w);
-				w = node->parent->right;
-			  }
-			/*case 4: sibling is black and its right child is red.
-			  Make siblings right black and nodes paren't black.
-			  Sibling gets the same color as parent. Perform left rotate on parent.
-			 */
-			  w->color = node->parent->color;
-			  node->parent->color = BLACK;
-			  w->right->color = BLACK;
-			  left_rotate(tree, node->parent);
-			  node = tree->root;
-			}
-		}
-		else {
-			/*Symmetric case where node is parent's right child.*/
-			w = node->parent->left;
-			if (w->color == RED){
-				w->color = BLACK;
-				node->parent->color = RED;
-				right_rotate(tree, node->parent);
-				w = node->parent->left;
-			}
-			if (w->left->color == BLACK && w->right->color == BLACK){
-				w->color = RED;
-				node = node->parent;
-			}
-			else {
-			  if (w->left->color == BLACK){
-				w->right->color = BLACK;
-				w->color = RED;
-				left_rotate(tree, w);
-				w = node->parent->left;
-			  }
+	if (lo == hi)
+		return RB_NIL;
 
-			w->color = node->parent->color;
-			node->parent->color = BLACK;
-			w->left->color = BLACK;
-			right_rotate(tree, node->parent);
-			node = tree->root;
-			}
-		}
-	}
-	node->color = BLACK;
+	mid = lo + (hi - lo) / 2;
+	node = rb_tree_node_alloc(tree, keys[mid], rb_key_len(tree, keys[mid]),
+				  values != NULL ? values[mid] : NULL);
+	rb_set_color(node, (depth == red_depth) ? RED : BLACK);
+	node->left = rb_build_sorted(tree, keys, values, lo, mid, depth + 1, red_depth);
+	node->right = rb_build_sorted(tree, keys, values, mid + 1, hi, depth + 1, red_depth);
+	if (node->left != RB_NIL)
+		rb_set_parent(node->left, node);
+	if (node->right != RB_NIL)
+		rb_set_parent(node->right, node);
+	rb_augment_node(tree, node);
+	return node;
 }
 
 
-extern struct rb_node* rb_search(struct rb_tree* tree, char* key){
+/*
+   Splitting at the middle element makes every leaf link sit at depth h or h+1,
+   where h = floor(log2(n)). Colouring depth h red (when that level is not full)
+   and everything above it black gives every path h black nodes.
+*/
+extern bool rb_tree_build_sorted(struct rb_tree* tree, char** keys, char** values, size_t n){
 
-	struct rb_node* node = tree->root;
-	
-	while (node != SENTINEL() &&\
-	       NOT_EQUAL(node->key, key, STRING_NOT_EQUAL)){
+	size_t h = 0, red_depth;
 
-		node = LESS_THAN(key, node->key, STRING_LESS_THAN) ? node->left : node->right;
-	}
+	if (tree->root != RB_NIL || (tree->augment & RB_AUGMENT_INTERVAL))
+		return false;
+	if (n == 0)
+		return true;
 
-	return node == SENTINEL() ? NULL : node;
+	while ((n >> (h + 1)) != 0)
+		h++;
+	/* A full bottom level (n == 2^(h+1) - 1) stays black. */
+	red_depth = (n + 1 == ((size_t) 2 << h)) ? (size_t) -1 : h;
+
+	tree->root = rb_build_sorted(tree, keys, values, 0, n, 0, red_depth);
+	rb_set_parent(tree->root, RB_NIL);
+	rb_set_color(tree->root, BLACK);
+	tree->max = tree_maximum(tree->root);
+	tree->count = n;
+	return true;
 }
 
 
 extern struct rb_node* tree_minimum(struct rb_node* node){
 
-	while (node->left != SENTINEL()){
+	while (node->left != RB_NIL){
 		node = node->left;
 	}
 	return node;
@@ -376,7 +1713,7 @@ extern struct rb_node* tree_minimum(struct rb_node* node){
 
 extern struct rb_node* tree_maximum(struct rb_node* node){
 
-	while (node->right != SENTINEL()){
+	while (node->right != RB_NIL){
 		node = node->right;
 	}
 	return node;
@@ -387,15 +1724,15 @@ extern struct rb_node* tree_successor(struct rb_node* node){
 
 	struct rb_node* y;
 
-	if (node->right != SENTINEL())
+	if (node->right != RB_NIL)
 		return tree_minimum(node->right);
 
-	y = node->parent;
+	y = rb_parent(node);
 
-	while (y != SENTINEL() && node == y->right){
+	while (y != RB_NIL && node == y->right){
 
 		node = y;
-		y = y->parent;
+		y = rb_parent(y);
 	}
 
 	return y;
@@ -405,14 +1742,14 @@ extern struct rb_node* tree_predecessor(struct rb_node* node){
 
 	struct rb_node* y;
 
-	if (node->left != SENTINEL())
+	if (node->left != RB_NIL)
 		return tree_maximum(node->left);
 
-	y = node->parent;
+	y = rb_parent(node);
 
-	while (y != SENTINEL() && node == y->left){
+	while (y != RB_NIL && node == y->left){
 		node = y;
-		y = y->parent;
+		y = rb_parent(y);
 	}
 
 	return y;
@@ -423,29 +1760,95 @@ extern struct rb_node* rb_node_alloc(struct rb_node* parent, struct rb_node* lef
 				     struct rb_node* right, char* key, char* data){
 
 	struct rb_node* node = malloc(sizeof(struct rb_node));
-	node->key = (char *) malloc((strlen(key) + 1) * sizeof(char));
-	node->parent = SENTINEL();
-	node->left = SENTINEL();
-	node->right = SENTINEL();
+	rb_node_set_key(node, NULL, key, strlen(key), RB_COPY);
+	rb_init_parent_color(node, RB_NIL, RED);
+	rb_set_bare(node);
+	node->left = RB_NIL;
+	node->right = RB_NIL;
 	node->data = data;
-	strcpy(node->key, key);
-	strcat(node->key, "\0");
 	return node;
 }
 				     
 extern struct rb_node* rb_node_alloc_kv(char* key, char* value){
 
 	struct rb_node* node = (struct rb_node *)  malloc(sizeof(struct rb_node));
-	node->key = (char *) malloc((strlen(key) + 1) * sizeof(char));
-	node->data = (char *) malloc((strlen(key) + 1) * sizeof(char));
-	strcpy(node->key, key);
-	strcat(node->key, "\0");
+	rb_node_set_key(node, NULL, key, strlen(key), RB_COPY);
+	rb_init_parent_color(node, RB_NIL, RED);
+	rb_set_bare(node);
+	node->data = (char *) malloc((strlen(value) + 1) * sizeof(char));
 	strcpy(node->data, value);
 
 	return node;
 }
 
 
+extern struct rb_node* rb_tree_node_alloc_kv(struct rb_tree* tree, char* key, char* value){
+
+	return rb_tree_node_alloc(tree, key, rb_key_len(tree, key), value);
+}
+
+
+extern struct rb_node* rb_tree_node_alloc(struct rb_tree* tree, const void* key, size_t key_len, char* value){
+
+	struct rb_node* node;
+
+	if (tree->pool == NULL){
+		node = (struct rb_node *) malloc(tree->node_size);
+		RB_STAT(tree, node_allocs);
+		rb_node_set_key(node, NULL, key, key_len, tree->key_ownership);
+	}
+	else {
+		node = rb_pool_node(tree->pool);
+		RB_STAT(tree, node_allocs);
+		rb_node_set_key(node, tree->pool, key, key_len, tree->key_ownership);
+	}
+	/* rb_set_parent and rb_set_color each keep the other's bit, so neither may
+	   read what the memory held before. */
+	rb_init_parent_color(node, RB_NIL, RED);
+	node->data = rb_tree_copy_value(tree, value);
+
+	/* Nodes that reach an interval tree through set() or rb_upsert hold [lo, lo]. */
+	if (tree->augment & RB_AUGMENT_INTERVAL){
+		memcpy(&rb_node_interval(node)->hi, node->key, sizeof(int64_t));
+		rb_node_interval(node)->max_hi = rb_node_interval(node)->hi;
+	}
+	return node;
+}
+
+
+/* Copies a value string into the tree's pool or the heap, unless the tree
+   borrows or takes its data. NULL stays NULL. */
+static char* rb_tree_copy_value(struct rb_tree* tree, char* value){
+
+	size_t value_size;
+	char* copy;
+
+	if (value == NULL || tree->data_ownership != RB_COPY)
+		return value;
+
+	value_size = strlen(value) + 1;
+	if (tree->pool != NULL)
+		copy = rb_pool_bytes(tree->pool, value_size);
+	else
+		copy = malloc(value_size);
+	memcpy(copy, value, value_size);
+	return copy;
+}
+
+
+extern void rb_tree_free_node(struct rb_tree* tree, struct rb_node* node){
+
+	RB_STAT(tree, node_frees);
+	rb_tree_release_node(tree, node, NULL, NULL);
+	if (tree->pool == NULL){
+		free(node);
+		return;
+	}
+	node->left = tree->pool->free_list;
+	tree->pool->free_list = node;
+}
+
+
 extern bool LESS_THAN(void *a, void *b, bool (*comparator)(void* , void* )){
 	return comparator(a, b);
 }
@@ -456,40 +1859,114 @@ extern bool  NOT_EQUAL(void *a, void *b, bool(*comparator)(void*, void*)){
 }
 
 
-extern bool STRING_LESS_THAN(void *A, void *B){
-	char* a = A;
-	char* b = B;
-	size_t i, j;
-	if (strlen(a) < strlen(b)) return true;
-	else if(strlen(a) > strlen(b)) return false;
+extern int STRING_COMPARE(const void *a, size_t a_len, const void *b, size_t b_len){
 
-	for (i = 0, j = 0; i < strlen(a); i++, j++){
-		if (a[i] < b[j]) return true;
-		else if (a[i] > b[j]) return false;
+	if (a_len != b_len)
+		return (a_len < b_len) ? -1 : 1;
+	return memcmp(a, b, a_len);
+}
+
+
+extern unsigned int rb_key_type_resolve(unsigned int key_type, rb_compare_fn custom,
+					rb_compare_fn* compare, size_t* key_size){
+
+	*key_size = 0;
+	switch (key_type){
+	case RB_KEY_STRING:
+		*compare = STRING_COMPARE;
+		break;
+	case RB_KEY_INT64:
+		*compare = INT64_COMPARE;
+		*key_size = sizeof(int64_t);
+		break;
+	case RB_KEY_UINT64:
+		*compare = UINT64_COMPARE;
+		*key_size = sizeof(uint64_t);
+		break;
+	case RB_KEY_DOUBLE:
+		*compare = DOUBLE_COMPARE;
+		*key_size = sizeof(double);
+		break;
+	case RB_KEY_BYTES:
+		*compare = BYTES_COMPARE;
+		break;
+	case RB_KEY_CUSTOM:
+		*compare = custom;
+		break;
+	default:
+		*compare = NULL;
+		break;
 	}
-	return false;
+	return key_type;
 }
 
 
-extern bool STRING_NOT_EQUAL(void *A, void *B){
-	char* a = A;
-	char* b = B;
-	size_t i, j;
+extern int INT64_COMPARE(const void *a, size_t a_len, const void *b, size_t b_len){
 
-	if (strlen(a) != strlen(b))
-		return true;
+	int64_t x, y;
+	(void) a_len; (void) b_len;
+	memcpy(&x, a, sizeof(x));
+	memcpy(&y, b, sizeof(y));
+	return (x > y) - (x < y);
+}
 
-	for (i = 0, j = 0; i < strlen(a); i++, j++){
-		if (a[i] != b[j])
-			return true;
-	}
-	return false;
+
+extern int UINT64_COMPARE(const void *a, size_t a_len, const void *b, size_t b_len){
+
+	uint64_t x, y;
+	(void) a_len; (void) b_len;
+	memcpy(&x, a, sizeof(x));
+	memcpy(&y, b, sizeof(y));
+	return (x > y) - (x < y);
+}
+
+
+extern int DOUBLE_COMPARE(const void *a, size_t a_len, const void *b, size_t b_len){
+
+	double x, y;
+	(void) a_len; (void) b_len;
+	memcpy(&x, a, sizeof(x));
+	memcpy(&y, b, sizeof(y));
+	return (x > y) - (x < y);
+}
+
+
+extern int BYTES_COMPARE(const void *a, size_t a_len, const void *b, size_t b_len){
+
+	int cmp = memcmp(a, b, (a_len < b_len) ? a_len : b_len);
+	if (cmp != 0)
+		return cmp;
+	return (a_len > b_len) - (a_len < b_len);
+}
+
+
+extern bool STRING_LESS_THAN(void *a, void *b){
+
+	return STRING_COMPARE(a, strlen(a), b, strlen(b)) < 0;
+}
+
+
+extern bool STRING_NOT_EQUAL(void *a, void *b){
+
+	return STRING_COMPARE(a, strlen(a), b, strlen(b)) != 0;
+}
+
+
+extern bool INT_LESS_THAN(void *a, void *b){
+
+	return *(int*) a < *(int*) b;
+}
+
+
+extern bool INT_NOT_EQUAL(void *a, void *b){
+
+	return *(int*) a != *(int*) b;
 }
 
 
 extern void __LIST_KEYS_SORTED(struct rb_node* node){
 
-	if (node == SENTINEL()) return;
+	if (node == RB_NIL) return;
 	__LIST_KEYS_SORTED(node->left);
 	__PRINT_NODE(node);
 	__LIST_KEYS_SORTED(node->right);
@@ -501,8 +1978,8 @@ extern void __PRINT_NODE(struct rb_node* node){
 	printf(
 	       "Node: %s, Color: %d, P: %s, LC: %s, RC: %s\n",	\
 	       node->key,
-	       node->color,
-	       node->parent->key,
+	       rb_color(node),
+	       rb_parent(node)->key,
 	       node->left->key,
 	       node->right->key
 	       );
@@ -512,53 +1989,50 @@ extern void __PRINT_NODE(struct rb_node* node){
 
 extern void set(struct rb_tree *tree, char *key, char* data){
 
+	bool inserted;
+	struct rb_node* node = rb_upsert(tree, key, rb_key_len(tree, key), &inserted);
 
-	struct rb_node* candidate = rb_search(tree, key);
-
-	if (candidate != SENTINEL()){
-		candidate->data = data;
+	if (inserted){
+		node->data = rb_tree_copy_value(tree, data);
 	}
-	else{
-		struct rb_node* new_node = rb_node_alloc_kv(key, data);
-		rb_insert(tree, new_node);
+	else {
+		/* A taken key that matched an existing one is not needed. */
+		if (tree->key_ownership == RB_TAKE)
+			free(key);
+		/* Release the old value as the tree would on delete. */
+		if (node->data != data){
+			if (rb_tree_owns_data(tree))
+				free(node->data);
+			node->data = rb_tree_copy_value(tree, data);
+		}
 	}
-	
+	if (tree->augment & RB_AUGMENT_AGGREGATE)
+		rb_augment_path(tree, node);
 }
 
 
 extern bool delete(struct rb_tree *tree, char *key){
-	struct rb_node *candidate = rb_search(tree, key);
 
-	if (candidate != NULL && candidate != SENTINEL()){
-		rb_delete(tree, candidate);
-		rb_free(candidate);
-		return true;
-	}
-
-	return false;
+	return rb_delete_key(tree, key, rb_key_len(tree, key));
 }
 
 
 extern bool is_member(struct rb_tree* tree, char* key){
 
-	struct rb_node *candidate = rb_search(tree, key);
-
-	if (candidate != SENTINEL())
-		return true;
-	return false;
-	
+	return rb_search(tree, key) != NULL;
 }
 
 
 extern void rb_free(struct rb_node* node){
 
 	free(node->data);
-	free(node->key);
+	if (!RB_KEY_INLINE(node))
+		free(node->key);
 	free(node);
 }
 
 void _print_tree_recursive(struct rb_node* node){
-        if (!node || node == SENTINEL())
+        if (!node || node == RB_NIL)
 		return;
 	__PRINT_NODE(node);
 	_print_tree_recursive(node->left);
@@ -1,22 +1,184 @@
 /**/
+#ifndef RBTREE_H
+#define RBTREE_H
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Keys shorter than this (plus their terminating NUL) are stored inside the node
+   and node->key points at key_buf. Longer keys live in a separate allocation.
+   Compact nodes (RB_COMPACT_COLOR below) default to 12 so the node ends with
+   key_len, with no padding after it. */
+#ifndef RB_INLINE_KEY_SIZE
+#ifdef RB_COMPACT_COLOR
+#define RB_INLINE_KEY_SIZE 12
+#else
+#define RB_INLINE_KEY_SIZE 16
+#endif
+#endif
 
 struct rb_node{
 
+#ifdef RB_COMPACT_COLOR
+	uintptr_t parent_color;	/* parent pointer, colour in bit 0, bare in bit 1; use rb_parent/rb_color */
+#else
 	struct rb_node* parent;
+#endif
 	struct rb_node* left;
 	struct rb_node* right;
 	void* key;
 	void* data;
+	char key_buf[RB_INLINE_KEY_SIZE];	/* pointer aligned, so numeric keys can be read in place */
+	uint32_t key_len;
+#ifndef RB_COMPACT_COLOR
 	unsigned int color:1;
+	unsigned int bare:1;	/* from rb_node_alloc*, so without aux fields */
+#endif
+	uint64_t aux[];		/* tree->aux_size bytes of per-tree node fields (rb_interval, sizes) */
+};
+
+/* Parent and colour accessors. Build with -DRB_COMPACT_COLOR to keep the colour
+   in the low bit of the parent pointer (nodes are at least pointer aligned).
+   With the 12 byte key buffer that takes a node from 64 to 56 bytes on LP64, so
+   an order-statistics node (8 bytes of aux) fits one cache line; keys of 12 to
+   15 bytes move out of the node. Without the colour bit a 12 byte buffer would
+   still pad to 64. rb_init_parent_color sets both at once, for fresh nodes, and
+   clears the bare mark rb_node_alloc* leaves on nodes that have no aux fields. */
+#ifdef RB_COMPACT_COLOR
+#define rb_parent(n)		((struct rb_node*) ((n)->parent_color & ~(uintptr_t) 3))
+#define rb_color(n)		((unsigned int) ((n)->parent_color & 1))
+#define rb_bare(n)		((bool) ((n)->parent_color & 2))
+#define rb_set_parent(n, p)	((n)->parent_color = (uintptr_t) (p) | ((n)->parent_color & 3))
+#define rb_set_color(n, c)	((n)->parent_color = ((n)->parent_color & ~(uintptr_t) 1) | (uintptr_t) (c))
+#define rb_set_bare(n)		((n)->parent_color |= 2)
+#define rb_init_parent_color(n, p, c)	((n)->parent_color = (uintptr_t) (p) | (uintptr_t) (c))
+#else
+#define rb_parent(n)		((n)->parent)
+#define rb_color(n)		((n)->color)
+#define rb_bare(n)		((bool) (n)->bare)
+#define rb_set_parent(n, p)	((n)->parent = (p))
+#define rb_set_color(n, c)	((n)->color = (c))
+#define rb_set_bare(n)		((n)->bare = 1)
+#define rb_init_parent_color(n, p, c)	((n)->parent = (p), (n)->color = (c), (n)->bare = 0)
+#endif
+
+/* What a tree does with the keys and data it is given (rb_tree_options).
+   RB_COPY:   copies them; the tree frees its copies (or leaves them to the pool).
+   RB_BORROW: stores the caller's pointer and never frees it; the caller keeps it
+              alive and unchanged while it is in the tree.
+   RB_TAKE:   stores the caller's malloc'd pointer and frees it with free() when
+              the node is freed or, for data, replaced by set().
+   Keys shorter than RB_INLINE_KEY_SIZE are copied into the node in every mode
+   (a taken one is freed straight away); that costs less than the pointer chase
+   it saves on every later comparison. */
+enum rb_ownership{
+	RB_COPY = 0,
+	RB_BORROW,
+	RB_TAKE
+};
+
+/* Interval trees key each node by the interval's low end and keep the high end,
+   plus the largest high end in the node's subtree, in the node's aux fields. */
+struct rb_interval{
+	int64_t hi;
+	int64_t max_hi;
+};
+
+/* Three-way comparison of two keys given with their lengths:
+   <0, 0 or >0 as the first key orders before, equal to or after the second. */
+typedef int (*rb_compare_fn)(const void*, size_t, const void*, size_t);
+
+/* Key types a tree can be created with (stored in rb_tree.keyType).
+   Numeric keys are passed as a pointer to the value and compared as machine words. */
+enum rb_key_type{
+	RB_KEY_STRING = 0,	/* NUL-terminated strings, STRING_COMPARE order */
+	RB_KEY_INT64,
+	RB_KEY_UINT64,
+	RB_KEY_DOUBLE,		/* NaN keys are not supported */
+	RB_KEY_BYTES,		/* arbitrary bytes, lexicographic, shorter prefix first */
+	RB_KEY_CUSTOM		/* rb_tree_options.compare */
+};
+
+/* Largest aggregate an rb_aggregate may describe; range queries keep a few on the stack. */
+#define RB_AGGREGATE_MAX 64
+
+/* A monoid summarising the values of a subtree, kept in every node's aux fields.
+   A node's aggregate is combine(combine(left's, value(node)), right's); empty
+   subtrees contribute identity. combine must be associative but need not be
+   commutative, and its output never aliases its inputs. */
+struct rb_aggregate{
+	size_t size;	/* bytes, at most RB_AGGREGATE_MAX; stored 8-byte aligned */
+	void (*identity)(void* out);
+	void (*value)(void* out, const struct rb_node* node);
+	void (*combine)(void* out, const void* left, const void* right);
+};
+
+struct rb_pool;
+
+/* Operation counters, kept only when built with -DRB_STATS. */
+struct rb_stats{
+	uint64_t compares;
+	uint64_t left_rotations;
+	uint64_t right_rotations;
+	uint64_t insert_case1;		/* red uncle: recolour and move up */
+	uint64_t insert_case2;		/* black uncle, inner child: extra rotation */
+	uint64_t insert_case3;		/* black uncle: final rotation */
+	uint64_t delete_fixup_iterations;
+	uint64_t node_allocs;		/* rb_tree_node_alloc */
+	uint64_t node_frees;		/* rb_tree_free_node and per-node destroy/clear */
 };
 
 struct rb_tree{
 	struct rb_node* root;
 	unsigned int keyType;
 	unsigned int dataType;
+	struct rb_pool* pool;
+	rb_compare_fn compare;
+	size_t key_size;	/* fixed key length for numeric key types, 0 otherwise */
+	unsigned int augment;	/* RB_AUGMENT_* bits: per-node fields kept up to date */
+	size_t aux_size;	/* bytes of rb_node.aux in this tree's nodes */
+	size_t node_size;	/* sizeof(struct rb_node) + aux_size */
+	struct rb_aggregate aggregate;
+	size_t aggregate_offset;	/* of the aggregate within rb_node.aux */
+	size_t size_offset;	/* of the subtree size within rb_node.aux (order_stats) */
+	enum rb_ownership key_ownership;
+	enum rb_ownership data_ownership;
+	struct rb_node* max;	/* rightmost node (RB_NIL if empty), so appends skip the descent */
+	size_t count;		/* nodes in the tree */
+#ifdef RB_STATS
+	struct rb_stats stats;
+#endif
+};
+
+#define RB_AUGMENT_SIZE 1u
+#define RB_AUGMENT_INTERVAL 2u
+#define RB_AUGMENT_AGGREGATE 4u
+
+/* Options for rb_tree_alloc_with. A zeroed struct gives the same tree as rb_tree_alloc.
+   rb_tree_alloc_with returns NULL if they are inconsistent. */
+struct rb_tree_options{
+	/* Nodes per slab chunk. 0 allocates every node, key and value with malloc. */
+	size_t pool_chunk_nodes;
+	enum rb_key_type key_type;
+	rb_compare_fn compare;	/* required for RB_KEY_CUSTOM, ignored otherwise */
+	/* Keep subtree sizes (in rb_node.aux) for rb_select, rb_rank and rb_count_range. */
+	bool order_stats;
+	/* Make an interval tree (int64 keys; see rb_interval_insert). Implies RB_KEY_INT64. */
+	bool interval;
+	/* Keep this subtree aggregate in every node (copied; see rb_aggregate_range). */
+	const struct rb_aggregate* aggregate;
+	/* How keys and data are held; RB_COPY (the default) copies both. */
+	enum rb_ownership key_ownership;
+	enum rb_ownership data_ownership;
 };
 
+/* The leaf and root-parent sentinel shared by all trees. Read-only. */
+extern struct rb_node rb_sentinel;
+
+#define RB_NIL (&rb_sentinel)
+
+/* Kept for existing callers; returns RB_NIL. */
 struct rb_node* SENTINEL();
 
 extern struct rb_node* tree_minimum(struct rb_node*);
@@ -35,33 +197,271 @@ void left_rotate(struct rb_tree*, struct rb_node*);
 
 void right_rotate(struct rb_tree*, struct rb_node*);
 
+/* Links node into the tree. Trees with augmented fields (order_stats, interval,
+   aggregate) keep them after the node, so they need nodes from rb_tree_node_alloc*; a
+   node from rb_node_alloc* is left out of such a tree, still the caller's.
+   The same holds for rb_insert_hint. */
 extern void rb_insert(struct rb_tree*, struct rb_node*);
 
+/* Inserts node starting from hint, a node of the tree near node's key (NULL
+   means the root). The search climbs from hint only until the subtree covers
+   the key, so it costs O(log d) comparisons for a key d positions away, and
+   O(1) amortised when keys arrive in ascending order with the last insert as
+   the hint. A key at or past the maximum is placed in O(1) from any hint below
+   it, at the cost of one extra comparison when the hint is not the maximum. */
+extern void rb_insert_hint(struct rb_tree*, struct rb_node*, struct rb_node*);
+
+/* rb_find starting from finger, a node of the tree (NULL means the root),
+   with the same climb as rb_insert_hint. */
+extern struct rb_node* rb_finger_search(struct rb_tree*, struct rb_node*, const void*, size_t);
+
+/* Returns the node holding key, inserting a new one (with NULL data) if there is none,
+   in a single descent. *inserted, when not NULL, tells whether the node is new.
+   The key is stored per the tree's key_ownership only when it is inserted. */
+extern struct rb_node* rb_upsert(struct rb_tree*, const void*, size_t, bool*);
+
+/* Fills an empty tree with n entries whose keys are in strictly ascending order,
+   in O(n) with no comparisons or rotations. values may be NULL.
+   Returns false (and does nothing) if the tree is not empty or is an interval tree. */
+extern bool rb_tree_build_sorted(struct rb_tree*, char**, char**, size_t);
+
 void rb_insert_fixup(struct rb_tree*, struct rb_node*);
 
 extern struct rb_node* rb_delete(struct rb_tree*, struct rb_node*);
 
+/* Finds, unlinks and frees the node holding key in one descent. False if absent. */
+extern bool rb_delete_key(struct rb_tree*, const void*, size_t);
+
 extern struct rb_node* rb_search(struct rb_tree*, char*);
 
+/* rb_search with an explicit key length. Returns NULL when the key is absent. */
+extern struct rb_node* rb_find(struct rb_tree*, const void*, size_t);
+
+/* Ordered queries. Each returns NULL when no key qualifies.
+   rb_lower_bound / rb_ceiling: first key >= k.  rb_upper_bound: first key > k.
+   rb_floor: last key <= k. */
+extern struct rb_node* rb_lower_bound(struct rb_tree*, const void*, size_t);
+
+extern struct rb_node* rb_upper_bound(struct rb_tree*, const void*, size_t);
+
+extern struct rb_node* rb_floor(struct rb_tree*, const void*, size_t);
+
+extern struct rb_node* rb_ceiling(struct rb_tree*, const void*, size_t);
+
+/* Order statistics, for trees created with order_stats; O(log n).
+   rb_select: the node with k smaller keys (k counts from 0), NULL if k >= size.
+   rb_rank: the number of keys < key.  rb_count_range: the number of keys in [lo, hi]. */
+extern struct rb_node* rb_select(struct rb_tree*, size_t);
+
+extern size_t rb_rank(struct rb_tree*, const void*, size_t);
+
+extern size_t rb_count_range(struct rb_tree*, const void*, size_t, const void*, size_t);
+
+/* The number of nodes, in O(1) for every tree. */
+extern size_t rb_tree_size(struct rb_tree*);
+
+/* Aggregate trees. rb_aggregate_range writes the combined value of the nodes with
+   lo <= key <= hi, in key order, to out in O(log n). rb_node_aggregate is the
+   aggregate of node's subtree. After changing a node's data in place, call
+   rb_aggregate_refresh on it; set() does so itself. The aggregate lives in the
+   node's aux fields, so nodes must come from rb_tree_node_alloc* (see rb_insert). */
+extern void rb_aggregate_range(struct rb_tree*, const void*, size_t, const void*, size_t, void*);
+
+extern void* rb_node_aggregate(struct rb_tree*, struct rb_node*);
+
+extern void rb_aggregate_refresh(struct rb_tree*, struct rb_node*);
+
+/* Called for each node of a scan; return false to stop. */
+typedef bool (*rb_visit_fn)(struct rb_node*, void*);
+
+/* Interval trees: closed intervals [lo, hi] keyed by lo; several may share a lo.
+   Remove them with rb_delete and rb_tree_free_node like any other node.
+   Nodes must come from the tree's allocator (rb_tree_node_alloc and friends),
+   since they carry the interval fields; rb_insert refuses rb_node_alloc* ones. Nodes added by set() or rb_upsert
+   hold the point interval [lo, lo]; to widen one, set its hi and call
+   rb_aggregate_refresh on it. */
+extern struct rb_node* rb_interval_insert(struct rb_tree*, int64_t, int64_t, char*);
+
+extern struct rb_interval* rb_node_interval(struct rb_node*);
+
+/* Visits every interval overlapping [lo, hi], ordered by low end, in
+   O(min(n, k log n)) for k overlaps. Returns the number of intervals visited. */
+extern size_t rb_interval_overlaps(struct rb_tree*, int64_t, int64_t, rb_visit_fn, void*);
+
+/* Visits the nodes with lo <= key <= hi in ascending order: one descent to the
+   first of them, then successor steps. Returns the number of nodes visited. */
+extern size_t rb_range(struct rb_tree*, const void*, size_t, const void*, size_t, rb_visit_fn, void*);
+
+/* A red black tree of n nodes is less than 2 log2(n + 1) high, so this covers any
+   tree that fits in a 64-bit address space. */
+#define RB_ITER_MAX_DEPTH 128
+
+/* In-order cursor keeping the path from the root to the current node, so it needs
+   no allocation, no recursion and no parent-pointer climbing. Each call returns the
+   new current node, or NULL once the cursor has moved off either end (after which
+   it stays there). Any insert or delete on the tree invalidates the cursor. */
+struct rb_iter{
+	struct rb_node* path[RB_ITER_MAX_DEPTH];
+	int depth;
+};
+
+extern struct rb_node* rb_iter_first(struct rb_iter*, struct rb_tree*);
+
+extern struct rb_node* rb_iter_last(struct rb_iter*, struct rb_tree*);
+
+/* Positions the cursor at the first key >= the given key. */
+extern struct rb_node* rb_iter_seek(struct rb_iter*, struct rb_tree*, const void*, size_t);
+
+extern struct rb_node* rb_iter_next(struct rb_iter*);
+
+extern struct rb_node* rb_iter_prev(struct rb_iter*);
+
+/* Looks up n keys at once, interleaving the descents and prefetching each next
+   node so their cache misses overlap. out[i] is rb_find(keys[i]). key_lens may be
+   NULL, in which case lengths follow the tree's key type as in rb_search. */
+extern void rb_search_batch(struct rb_tree*, const void* const*, const size_t*, size_t, struct rb_node**);
+
 void rb_delete_fixup(struct rb_tree*, struct rb_node*);
 
 void rb_transplant(struct rb_tree*, struct rb_node*, struct rb_node*);
 
 struct rb_tree* rb_tree_alloc();
 
+extern struct rb_tree* rb_tree_alloc_with(const struct rb_tree_options*);
+
+/* Destructor for keys or data handed to rb_tree_destroy and rb_tree_clear. */
+typedef void (*rb_free_fn)(void*);
+
+/* Frees every node along with the tree, iteratively in O(n).
+   By default the tree frees the keys and data it owns (see rb_ownership).
+   A non-NULL free_key or free_data is called instead on each key or non-NULL
+   data held outside the tree's own memory: borrowed and taken ones, and the
+   heap copies of an unpooled tree. Keys stored inline in the node and copies
+   in a pool's chunks are never passed to them; they go with the node or the
+   chunks. Pooled trees with nothing outside the pool drop their chunks
+   without visiting a node. */
+extern void rb_tree_destroy(struct rb_tree*, rb_free_fn, rb_free_fn);
+
+/* Copies the tree's counters to out. Returns false (and zeroes out) when the
+   library was built without RB_STATS. Pooled trees with nothing outside the
+   pool free their nodes wholesale when destroyed or cleared and count no node_frees. */
+extern bool rb_tree_stats(const struct rb_tree*, struct rb_stats*);
+
+extern void rb_tree_stats_reset(struct rb_tree*);
+
+/* What rb_tree_validate found; RB_VALID (0) when every invariant holds. */
+enum rb_violation{
+	RB_VALID = 0,
+	RB_BAD_SENTINEL,	/* rb_sentinel was written to */
+	RB_RED_ROOT,
+	RB_BAD_PARENT,		/* a child's parent link does not point back */
+	RB_BAD_ORDER,		/* in-order keys are not ascending */
+	RB_RED_RED,		/* a red node has a red child */
+	RB_BLACK_HEIGHT,	/* two root-to-leaf paths differ in black nodes */
+	RB_BAD_AUGMENT,		/* subtree size, interval max or aggregate is stale */
+	RB_BAD_MAX		/* tree->max is not the rightmost node */
+};
+
+/* Checks the red black properties listed in rbtree.c plus the tree's own
+   bookkeeping, in one O(n) walk on parent pointers. Returns the first
+   violation found. Meant for tests, fuzzing and debug builds. */
+extern enum rb_violation rb_tree_validate(struct rb_tree*);
+
+#define RB_PROFILE_MAX_DEPTH 128
+#define RB_CACHE_LINE 64
+
+/* Shape of a tree, from rb_tree_profile. Depths count nodes on the path from
+   the root, so the root has depth 1 and a lookup of a node at depth d makes d
+   comparisons. */
+struct rb_profile{
+	size_t nodes;
+	unsigned int height;
+	unsigned int black_height;	/* black nodes on a root-to-leaf path */
+	double average_depth;
+	size_t depth_histogram[RB_PROFILE_MAX_DEPTH];	/* [d - 1]: nodes at depth d */
+	/* Average RB_CACHE_LINE lines a successful lookup reads: the link, key and
+	   length fields of every node on the path, plus the key bytes of keys
+	   stored outside the node, at their actual addresses. */
+	double cache_lines_per_lookup;
+	size_t node_bytes;		/* nodes * tree->node_size */
+	size_t key_bytes;		/* bytes of keys stored outside their nodes */
+};
+
+/* Walks the whole tree in O(n) time and O(1) extra space (parent pointers, no
+   recursion or stack), so it is safe on trees of any size. */
+extern void rb_tree_profile(struct rb_tree*, struct rb_profile*);
+
+/* Empties the tree like rb_tree_destroy but keeps it, and the first chunk of
+   each pool list, for reuse. */
+extern void rb_tree_clear(struct rb_tree*, rb_free_fn, rb_free_fn);
+
+/* Nodes from these two have no aux fields, so only plain trees take them. */
 struct rb_node* rb_node_alloc(struct rb_node*, struct rb_node*, struct rb_node*, char*, char*);
 
 struct rb_node* rb_node_alloc_kv(char*, char*);
 
+/* Allocates a node from the tree's pool when it has one, otherwise like rb_node_alloc_kv. 
+   The key length follows the tree's key type: strlen for strings, the word size for numbers. */
+extern struct rb_node* rb_tree_node_alloc_kv(struct rb_tree*, char*, char*);
+
+/* rb_tree_node_alloc_kv with an explicit key length. A NULL value is stored as NULL. */
+extern struct rb_node* rb_tree_node_alloc(struct rb_tree*, const void*, size_t, char*);
+
+/* Length of key under the tree's key type. */
+extern size_t rb_key_len(struct rb_tree*, const void*);
+
+/* Releases what the tree owns of the node's key and data, then returns the node
+   to the pool free list or frees it. */
+extern void rb_tree_free_node(struct rb_tree*, struct rb_node*);
+
 struct rb_node* search(struct rb_tree*, struct rb_node*);
 
 
+/* Orders shorter strings first, then bytewise; the order STRING_LESS_THAN defines. */
+extern int STRING_COMPARE(const void*, size_t, const void*, size_t);
+
+extern int INT64_COMPARE(const void*, size_t, const void*, size_t);
+
+extern int UINT64_COMPARE(const void*, size_t, const void*, size_t);
+
+extern int DOUBLE_COMPARE(const void*, size_t, const void*, size_t);
+
+extern int BYTES_COMPARE(const void*, size_t, const void*, size_t);
+
+/* Resolves a key type to its comparator and fixed key length (0 if variable);
+   custom is used for RB_KEY_CUSTOM. The comparator is NULL for RB_KEY_CUSTOM
+   without one and for unknown types, which every engine rejects. Returns the type. */
+extern unsigned int rb_key_type_resolve(unsigned int, rb_compare_fn, rb_compare_fn*, size_t*);
+
+/* Compares two keys of the given type. The switch lets every tree engine call
+   the built-in comparators directly instead of through a function pointer. */
+static inline int rb_compare_keys(unsigned int key_type, rb_compare_fn compare,
+				  const void* a, size_t a_len, const void* b, size_t b_len){
+
+	switch (key_type){
+	case RB_KEY_STRING:
+		return STRING_COMPARE(a, a_len, b, b_len);
+	case RB_KEY_INT64:
+		return INT64_COMPARE(a, a_len, b, b_len);
+	case RB_KEY_UINT64:
+		return UINT64_COMPARE(a, a_len, b, b_len);
+	case RB_KEY_DOUBLE:
+		return DOUBLE_COMPARE(a, a_len, b, b_len);
+	case RB_KEY_BYTES:
+		return BYTES_COMPARE(a, a_len, b, b_len);
+	default:
+		return compare(a, a_len, b, b_len);
+	}
+}
+
 /* Comparison operators for other types to be defined by caller.*/
 
 extern bool LESS_THAN(void* , void*, bool (*comparator)(void* , void* ));
 
 extern bool NOT_EQUAL(void*, void*, bool (*comparator)(void* , void* ));
 
+/* Inserts key or replaces its data, following the tree's rb_ownership modes.
+   A replaced value is released like a deleted one. */
 extern void set(struct rb_tree*, char*, char*);
 
 extern bool delete(struct rb_tree*, char*);
@@ -78,3 +478,5 @@ extern bool INT_LESS_THAN(void*, void*);
 extern bool STRING_NOT_EQUAL(void*, void*);
 
 extern bool INT_NOT_EQUAL(void*, void*);
+
+#endif
@@ -0,0 +1,359 @@
+/*
+   Index-linked red black tree; see rbtree_arena.h.
+
+   Unlike rb_sentinel, the sentinel here belongs to one tree, so delete may set
+   its parent the way CLRS does. Only its parent and colour are ever written by
+   the balancing code; its left/right links are the root and free list and are
+   only written on purpose.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "rbtree_arena.h"
+
+#define BLACK 0
+#define RED 1
+
+#define NODE(i) (arena->nodes[(i)])
+#define ROOT (arena->nodes[RB_ARENA_NIL].left)
+#define FREE_LIST (arena->nodes[RB_ARENA_NIL].right)
+
+
+static bool rb_arena_grow(struct rb_arena* arena){
+
+	struct rb_arena_node* nodes;
+	uint64_t capacity = (uint64_t) arena->capacity * 2;
+
+	if (capacity > RB_ARENA_MAX_NODES)
+		capacity = RB_ARENA_MAX_NODES;
+	if (capacity <= arena->capacity)
+		return false;
+
+	nodes = realloc(arena->nodes, capacity * sizeof(struct rb_arena_node));
+	if (nodes == NULL)
+		return false;
+	arena->nodes = nodes;
+	arena->capacity = (uint32_t) capacity;
+	return true;
+}
+
+
+static uint32_t rb_arena_slot(struct rb_arena* arena){
+
+	uint32_t slot = FREE_LIST;
+
+	if (slot != RB_ARENA_NIL){
+		FREE_LIST = NODE(slot).right;
+		return slot;
+	}
+	if (arena->used == arena->capacity && !rb_arena_grow(arena))
+		return RB_ARENA_NIL;
+	return arena->used++;
+}
+
+
+extern bool rb_arena_init(struct rb_arena* arena, uint32_t capacity){
+
+	if (capacity < 2)
+		capacity = 2;
+	arena->nodes = malloc((size_t) capacity * sizeof(struct rb_arena_node));
+	if (arena->nodes == NULL)
+		return false;
+	memset(&NODE(RB_ARENA_NIL), 0, sizeof(struct rb_arena_node));
+	arena->used = 1;
+	arena->capacity = capacity;
+	arena->count = 0;
+	return true;
+}
+
+
+extern void rb_arena_destroy(struct rb_arena* arena){
+
+	free(arena->nodes);
+	arena->nodes = NULL;
+	arena->used = arena->capacity = arena->count = 0;
+}
+
+
+static void rb_arena_left_rotate(struct rb_arena* arena, uint32_t x){
+
+	uint32_t y = NODE(x).right;
+
+	NODE(x).right = NODE(y).left;
+	if (NODE(y).left != RB_ARENA_NIL)
+		NODE(NODE(y).left).parent = x;
+	NODE(y).parent = NODE(x).parent;
+	if (NODE(x).parent == RB_ARENA_NIL)
+		ROOT = y;
+	else if (x == NODE(NODE(x).parent).left)
+		NODE(NODE(x).parent).left = y;
+	else
+		NODE(NODE(x).parent).right = y;
+	NODE(y).left = x;
+	NODE(x).parent = y;
+}
+
+
+static void rb_arena_right_rotate(struct rb_arena* arena, uint32_t y){
+
+	uint32_t x = NODE(y).left;
+
+	NODE(y).left = NODE(x).right;
+	if (NODE(x).right != RB_ARENA_NIL)
+		NODE(NODE(x).right).parent = y;
+	NODE(x).parent = NODE(y).parent;
+	if (NODE(y).parent == RB_ARENA_NIL)
+		ROOT = x;
+	else if (y == NODE(NODE(y).parent).left)
+		NODE(NODE(y).parent).left = x;
+	else
+		NODE(NODE(y).parent).right = x;
+	NODE(x).right = y;
+	NODE(y).parent = x;
+}
+
+
+static void rb_arena_insert_fixup(struct rb_arena* arena, uint32_t z){
+
+	uint32_t y;
+
+	while (NODE(NODE(z).parent).color == RED){
+		uint32_t p = NODE(z).parent;
+		uint32_t g = NODE(p).parent;
+
+		if (p == NODE(g).left){
+			y = NODE(g).right;
+			if (NODE(y).color == RED){
+				NODE(p).color = BLACK;
+				NODE(y).color = BLACK;
+				NODE(g).color = RED;
+				z = g;
+			}else{
+				if (z == NODE(p).right){
+					z = p;
+					rb_arena_left_rotate(arena, z);
+				}
+				NODE(NODE(z).parent).color = BLACK;
+				NODE(g).color = RED;
+				rb_arena_right_rotate(arena, g);
+			}
+		}else{
+			y = NODE(g).left;
+			if (NODE(y).color == RED){
+				NODE(p).color = BLACK;
+				NODE(y).color = BLACK;
+				NODE(g).color = RED;
+				z = g;
+			}else{
+				if (z == NODE(p).left){
+					z = p;
+					rb_arena_right_rotate(arena, z);
+				}
+				NODE(NODE(z).parent).color = BLACK;
+				NODE(g).color = RED;
+				rb_arena_left_rotate(arena, g);
+			}
+		}
+	}
+	NODE(ROOT).color = BLACK;
+}
+
+
+extern uint32_t rb_arena_insert(struct rb_arena* arena, int64_t key, uint64_t value, bool* inserted){
+
+	uint32_t y = RB_ARENA_NIL;
+	uint32_t x = ROOT;
+	uint32_t z;
+
+	if (inserted != NULL)
+		*inserted = false;
+
+	while (x != RB_ARENA_NIL){
+		y = x;
+		if (key < NODE(x).key)
+			x = NODE(x).left;
+		else if (key > NODE(x).key)
+			x = NODE(x).right;
+		else
+			return x;
+	}
+
+	z = rb_arena_slot(arena);
+	if (z == RB_ARENA_NIL)
+		return RB_ARENA_NIL;
+
+	NODE(z).parent = y;
+	NODE(z).left = NODE(z).right = RB_ARENA_NIL;
+	NODE(z).color = RED;
+	NODE(z).key = key;
+	NODE(z).value = value;
+
+	if (y == RB_ARENA_NIL)
+		ROOT = z;
+	else if (key < NODE(y).key)
+		NODE(y).left = z;
+	else
+		NODE(y).right = z;
+
+	rb_arena_insert_fixup(arena, z);
+	arena->count++;
+	if (inserted != NULL)
+		*inserted = true;
+	return z;
+}
+
+
+extern uint32_t rb_arena_find(const struct rb_arena* arena, int64_t key){
+
+	uint32_t x = ROOT;
+
+	while (x != RB_ARENA_NIL && NODE(x).key != key)
+		x = key < NODE(x).key ? NODE(x).left : NODE(x).right;
+	return x;
+}
+
+
+static uint32_t rb_arena_minimum(const struct rb_arena* arena, uint32_t x){
+
+	while (NODE(x).left != RB_ARENA_NIL)
+		x = NODE(x).left;
+	return x;
+}
+
+
+static void rb_arena_transplant(struct rb_arena* arena, uint32_t u, uint32_t v){
+
+	if (NODE(u).parent == RB_ARENA_NIL)
+		ROOT = v;
+	else if (u == NODE(NODE(u).parent).left)
+		NODE(NODE(u).parent).left = v;
+	else
+		NODE(NODE(u).parent).right = v;
+	NODE(v).parent = NODE(u).parent;
+}
+
+
+static void rb_arena_delete_fixup(struct rb_arena* arena, uint32_t x){
+
+	uint32_t w;
+
+	while (x != ROOT && NODE(x).color == BLACK){
+		uint32_t p = NODE(x).parent;
+
+		if (x == NODE(p).left){
+			w = NODE(p).right;
+			if (NODE(w).color == RED){
+				NODE(w).color = BLACK;
+				NODE(p).color = RED;
+				rb_arena_left_rotate(arena, p);
+				w = NODE(p).right;
+			}
+			if (NODE(NODE(w).left).color == BLACK && NODE(NODE(w).right).color == BLACK){
+				NODE(w).color = RED;
+				x = p;
+			}else{
+				if (NODE(NODE(w).right).color == BLACK){
+					NODE(NODE(w).left).color = BLACK;
+					NODE(w).color = RED;
+					rb_arena_right_rotate(arena, w);
+					w = NODE(p).right;
+				}
+				NODE(w).color = NODE(p).color;
+				NODE(p).color = BLACK;
+				NODE(NODE(w).right).color = BLACK;
+				rb_arena_left_rotate(arena, p);
+				x = ROOT;
+			}
+		}else{
+			w = NODE(p).left;
+			if (NODE(w).color == RED){
+				NODE(w).color = BLACK;
+				NODE(p).color = RED;
+				rb_arena_right_rotate(arena, p);
+				w = NODE(p).left;
+			}
+			if (NODE(NODE(w).right).color == BLACK && NODE(NODE(w).left).color == BLACK){
+				NODE(w).color = RED;
+				x = p;
+			}else{
+				if (NODE(NODE(w).left).color == BLACK){
+					NODE(NODE(w).right).color = BLACK;
+					NODE(w).color = RED;
+					rb_arena_left_rotate(arena, w);
+					w = NODE(p).left;
+				}
+				NODE(w).color = NODE(p).color;
+				NODE(p).color = BLACK;
+				NODE(NODE(w).left).color = BLACK;
+				rb_arena_right_rotate(arena, p);
+				x = ROOT;
+			}
+		}
+	}
+	NODE(x).color = BLACK;
+}
+
+
+extern bool rb_arena_delete(struct rb_arena* arena, int64_t key){
+
+	uint32_t z = rb_arena_find(arena, key);
+	uint32_t x, y;
+	uint32_t y_original_color;
+
+	if (z == RB_ARENA_NIL)
+		return false;
+
+	y = z;
+	y_original_color = NODE(y).color;
+	if (NODE(z).left == RB_ARENA_NIL){
+		x = NODE(z).right;
+		rb_arena_transplant(arena, z, NODE(z).right);
+	}else if (NODE(z).right == RB_ARENA_NIL){
+		x = NODE(z).left;
+		rb_arena_transplant(arena, z, NODE(z).left);
+	}else{
+		y = rb_arena_minimum(arena, NODE(z).right);
+		y_original_color = NODE(y).color;
+		x = NODE(y).right;
+		if (NODE(y).parent == z){
+			NODE(x).parent = y;
+		}else{
+			rb_arena_transplant(arena, y, NODE(y).right);
+			NODE(y).right = NODE(z).right;
+			NODE(NODE(y).right).parent = y;
+		}
+		rb_arena_transplant(arena, z, y);
+		NODE(y).left = NODE(z).left;
+		NODE(NODE(y).left).parent = y;
+		NODE(y).color = NODE(z).color;
+	}
+	if (y_original_color == BLACK)
+		rb_arena_delete_fixup(arena, x);
+
+	NODE(z).right = FREE_LIST;
+	FREE_LIST = z;
+	arena->count--;
+	return true;
+}
+
+
+extern uint32_t rb_arena_first(const struct rb_arena* arena){
+
+	if (ROOT == RB_ARENA_NIL)
+		return RB_ARENA_NIL;
+	return rb_arena_minimum(arena, ROOT);
+}
+
+
+extern uint32_t rb_arena_next(const struct rb_arena* arena, uint32_t x){
+
+	uint32_t y;
+
+	if (NODE(x).right != RB_ARENA_NIL)
+		return rb_arena_minimum(arena, NODE(x).right);
+	y = NODE(x).parent;
+	while (y != RB_ARENA_NIL && x == NODE(y).right){
+		x = y;
+		y = NODE(y).parent;
+	}
+	return y;
+}
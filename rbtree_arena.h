@@ -0,0 +1,64 @@
+/*
+   Index-linked red black tree for int64 keys and uint64 values.
+
+   Nodes live in one growable array and refer to each other by 32-bit index, so
+   a node is 32 bytes and the array holds no pointers: it can be copied,
+   written to disk or mapped at another address and used as it is. Index 0 is
+   the tree's own sentinel; its left link holds the root and its right link the
+   head of the free list, so the array alone describes the whole tree.
+
+   Indices stay valid until the node is deleted. Node addresses do not: any
+   insert may move the array, so look nodes up with RB_ARENA_NODE again after it.
+
+   The algorithms are the CLRS ones used by rbtree.c.
+*/
+#ifndef RBTREE_ARENA_H
+#define RBTREE_ARENA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RB_ARENA_NIL 0
+#define RB_ARENA_MAX_NODES UINT32_MAX
+
+struct rb_arena_node{
+	uint32_t parent;
+	uint32_t left;
+	uint32_t right;
+	uint32_t color;
+	int64_t key;
+	uint64_t value;
+};
+
+struct rb_arena{
+	struct rb_arena_node* nodes;	/* nodes[0] is the sentinel */
+	uint32_t used;			/* slots handed out so far, sentinel included */
+	uint32_t capacity;
+	uint32_t count;			/* nodes in the tree */
+};
+
+#define RB_ARENA_NODE(arena, i) (&(arena)->nodes[(i)])
+#define RB_ARENA_ROOT(arena) ((arena)->nodes[RB_ARENA_NIL].left)
+
+/* Sets up an empty tree with room for capacity nodes before it has to grow.
+   Returns false if the array can not be allocated. */
+extern bool rb_arena_init(struct rb_arena*, uint32_t);
+
+extern void rb_arena_destroy(struct rb_arena*);
+
+/* Inserts key with value unless it is present. Returns the index of the node
+   holding key, or RB_ARENA_NIL if the array could not grow. */
+extern uint32_t rb_arena_insert(struct rb_arena*, int64_t, uint64_t, bool*);
+
+/* Returns the index of key's node or RB_ARENA_NIL. */
+extern uint32_t rb_arena_find(const struct rb_arena*, int64_t);
+
+/* Removes key and puts its slot on the free list. Returns false if absent. */
+extern bool rb_arena_delete(struct rb_arena*, int64_t);
+
+/* In-order traversal; both return RB_ARENA_NIL past the end. */
+extern uint32_t rb_arena_first(const struct rb_arena*);
+
+extern uint32_t rb_arena_next(const struct rb_arena*, uint32_t);
+
+#endif
@@ -0,0 +1,332 @@
+/*
+   Persistent left-leaning red black tree; see rbtree_persist.h.
+
+   Updates run recursively down from the root and only ever change a node they
+   own: one whose count is 1 and that was reached through owned nodes, so no
+   other version can see it. rb_persist_own makes a node owned by copying it
+   when it is shared; the copy takes over the reference of the link it came
+   through. Rotations and colour flips own every node they touch, which keeps
+   all copying on the search path and the nodes hanging off it.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "rbtree_persist.h"
+
+#if defined(__GNUC__)
+#define RB_PERSIST_REFS(node) __atomic_load_n(&(node)->refs, __ATOMIC_ACQUIRE)
+#define RB_PERSIST_GET(node) __atomic_add_fetch(&(node)->refs, 1, __ATOMIC_RELAXED)
+#define RB_PERSIST_PUT(node) __atomic_sub_fetch(&(node)->refs, 1, __ATOMIC_ACQ_REL)
+#else
+#define RB_PERSIST_REFS(node) ((node)->refs)
+#define RB_PERSIST_GET(node) (++(node)->refs)
+#define RB_PERSIST_PUT(node) (--(node)->refs)
+#endif
+
+
+static inline bool rb_persist_red(const struct rb_persist_node* node){
+
+	return node != NULL && node->red;
+}
+
+
+static inline int rb_persist_compare(const struct rb_persist_tree* tree, const void* key, size_t len,
+				     const struct rb_persist_node* node){
+
+	return rb_compare_keys(tree->keyType, tree->compare, key, len, node->key, node->key_len);
+}
+
+
+static inline size_t rb_persist_node_size(size_t key_len){
+
+	return sizeof(struct rb_persist_node) + ((key_len + sizeof(uint64_t)) & ~(sizeof(uint64_t) - 1));
+}
+
+
+static struct rb_persist_node* rb_persist_node_alloc(const void* key, size_t len, void* data){
+
+	struct rb_persist_node* node = (struct rb_persist_node*) malloc(rb_persist_node_size(len));
+
+	node->link[0] = node->link[1] = NULL;
+	node->refs = 1;
+	node->red = 1;
+	node->data = data;
+	node->key_len = len;
+	memcpy(node->key, key, len);
+	((char*) node->key)[len] = '\0';
+	return node;
+}
+
+
+/* Drops one reference, freeing the node and releasing its children when it was
+   the last. Recursion is bounded by the height of the tree. */
+static void rb_persist_release(struct rb_persist_node* node){
+
+	if (node == NULL || RB_PERSIST_PUT(node) != 0)
+		return;
+	rb_persist_release(node->link[0]);
+	rb_persist_release(node->link[1]);
+	free(node);
+}
+
+
+/* Returns a version of node the caller may change, in place of the reference
+   it holds to node. */
+static struct rb_persist_node* rb_persist_own(struct rb_persist_node* node){
+
+	struct rb_persist_node* copy;
+	size_t size;
+
+	if (node == NULL || RB_PERSIST_REFS(node) == 1)
+		return node;
+
+	size = rb_persist_node_size(node->key_len);
+	copy = (struct rb_persist_node*) malloc(size);
+	memcpy(copy, node, size);
+	copy->refs = 1;
+	if (copy->link[0] != NULL)
+		RB_PERSIST_GET(copy->link[0]);
+	if (copy->link[1] != NULL)
+		RB_PERSIST_GET(copy->link[1]);
+	rb_persist_release(node);
+	return copy;
+}
+
+
+/* Rotations and flips take an owned node and return an owned subtree root. */
+static struct rb_persist_node* rb_persist_rotate(struct rb_persist_node* h, int dir){
+
+	struct rb_persist_node* x = rb_persist_own(h->link[!dir]);
+
+	h->link[!dir] = x->link[dir];
+	x->link[dir] = h;
+	x->red = h->red;
+	h->red = 1;
+	return x;
+}
+
+
+static void rb_persist_flip(struct rb_persist_node* h){
+
+	h->link[0] = rb_persist_own(h->link[0]);
+	h->link[1] = rb_persist_own(h->link[1]);
+	h->red = !h->red;
+	h->link[0]->red = !h->link[0]->red;
+	h->link[1]->red = !h->link[1]->red;
+}
+
+
+static struct rb_persist_node* rb_persist_balance(struct rb_persist_node* h){
+
+	if (rb_persist_red(h->link[1]) && !rb_persist_red(h->link[0]))
+		h = rb_persist_rotate(h, 0);
+	if (rb_persist_red(h->link[0]) && rb_persist_red(h->link[0]->link[0]))
+		h = rb_persist_rotate(h, 1);
+	if (rb_persist_red(h->link[0]) && rb_persist_red(h->link[1]))
+		rb_persist_flip(h);
+	return h;
+}
+
+
+static struct rb_persist_node* rb_persist_move_red_left(struct rb_persist_node* h){
+
+	rb_persist_flip(h);
+	if (rb_persist_red(h->link[1]->link[0])){
+		h->link[1] = rb_persist_rotate(h->link[1], 1);
+		h = rb_persist_rotate(h, 0);
+		rb_persist_flip(h);
+	}
+	return h;
+}
+
+
+static struct rb_persist_node* rb_persist_move_red_right(struct rb_persist_node* h){
+
+	rb_persist_flip(h);
+	if (rb_persist_red(h->link[0]->link[0])){
+		h = rb_persist_rotate(h, 1);
+		rb_persist_flip(h);
+	}
+	return h;
+}
+
+
+static struct rb_persist_node* rb_persist_insert_node(struct rb_persist_tree* tree, struct rb_persist_node* h,
+						      const void* key, size_t len, void* data, bool* inserted){
+
+	int cmp, dir;
+
+	if (h == NULL){
+		*inserted = true;
+		return rb_persist_node_alloc(key, len, data);
+	}
+
+	cmp = rb_persist_compare(tree, key, len, h);
+	if (cmp == 0){
+		h->data = data;
+		return h;
+	}
+	dir = cmp > 0;
+	h->link[dir] = rb_persist_insert_node(tree, rb_persist_own(h->link[dir]), key, len, data, inserted);
+	return rb_persist_balance(h);
+}
+
+
+/* Unlinks the minimum of h's subtree and hands it, still owned, to *min.
+   In a left-leaning tree the minimum has no children. */
+static struct rb_persist_node* rb_persist_delete_min(struct rb_persist_node* h, struct rb_persist_node** min){
+
+	if (h->link[0] == NULL){
+		*min = h;
+		return NULL;
+	}
+	if (!rb_persist_red(h->link[0]) && !rb_persist_red(h->link[0]->link[0]))
+		h = rb_persist_move_red_left(h);
+	h->link[0] = rb_persist_delete_min(rb_persist_own(h->link[0]), min);
+	return rb_persist_balance(h);
+}
+
+
+/* The key is known to be in h's subtree. */
+static struct rb_persist_node* rb_persist_delete_node(struct rb_persist_tree* tree, struct rb_persist_node* h,
+						      const void* key, size_t len){
+
+	struct rb_persist_node* min;
+
+	if (rb_persist_compare(tree, key, len, h) < 0){
+		if (!rb_persist_red(h->link[0]) && !rb_persist_red(h->link[0]->link[0]))
+			h = rb_persist_move_red_left(h);
+		h->link[0] = rb_persist_delete_node(tree, rb_persist_own(h->link[0]), key, len);
+		return rb_persist_balance(h);
+	}
+
+	if (rb_persist_red(h->link[0]))
+		h = rb_persist_rotate(h, 1);
+	if (h->link[1] == NULL){
+		/* Only the matching node can be reached with no right child. */
+		free(h);
+		return NULL;
+	}
+	if (!rb_persist_red(h->link[1]) && !rb_persist_red(h->link[1]->link[0]))
+		h = rb_persist_move_red_right(h);
+
+	if (rb_persist_compare(tree, key, len, h) == 0){
+		/* The successor node takes h's place, so no key is ever copied. */
+		h->link[1] = rb_persist_delete_min(rb_persist_own(h->link[1]), &min);
+		min->link[0] = h->link[0];
+		min->link[1] = h->link[1];
+		min->red = h->red;
+		free(h);
+		h = min;
+	}else{
+		h->link[1] = rb_persist_delete_node(tree, rb_persist_own(h->link[1]), key, len);
+	}
+	return rb_persist_balance(h);
+}
+
+
+extern struct rb_persist_tree* rb_persist_alloc(const struct rb_tree_options* options){
+
+	struct rb_persist_tree* tree = (struct rb_persist_tree*) malloc(sizeof(struct rb_persist_tree));
+	memset(tree, 0, sizeof(*tree));
+	tree->keyType = rb_key_type_resolve(options != NULL ? options->key_type : RB_KEY_STRING,
+					    options != NULL ? options->compare : NULL,
+					    &tree->compare, &tree->key_size);
+	if (tree->compare == NULL){
+		free(tree);
+		return NULL;
+	}
+	return tree;
+}
+
+
+extern void rb_persist_destroy(struct rb_persist_tree* tree){
+
+	rb_persist_release(tree->root);
+	free(tree);
+}
+
+
+extern struct rb_persist_tree* rb_snapshot(struct rb_persist_tree* tree){
+
+	struct rb_persist_tree* snapshot = (struct rb_persist_tree*) malloc(sizeof(struct rb_persist_tree));
+
+	*snapshot = *tree;
+	if (snapshot->root != NULL)
+		RB_PERSIST_GET(snapshot->root);
+	return snapshot;
+}
+
+
+extern bool rb_persist_insert(struct rb_persist_tree* tree, const void* key, size_t len, void* data){
+
+	bool inserted = false;
+
+	tree->root = rb_persist_insert_node(tree, rb_persist_own(tree->root), key, len, data, &inserted);
+	tree->root->red = 0;
+	tree->count += inserted;
+	return inserted;
+}
+
+
+/* The descent restructures the path whether or not the key is there, so it is
+   looked up first and an absent key copies nothing. */
+extern bool rb_persist_delete(struct rb_persist_tree* tree, const void* key, size_t len){
+
+	struct rb_persist_node* root;
+
+	if (rb_persist_find(tree, key, len) == NULL)
+		return false;
+
+	root = rb_persist_own(tree->root);
+	if (!rb_persist_red(root->link[0]) && !rb_persist_red(root->link[1]))
+		root->red = 1;
+	tree->root = rb_persist_delete_node(tree, root, key, len);
+	if (tree->root != NULL)
+		tree->root->red = 0;
+	tree->count--;
+	return true;
+}
+
+
+extern const struct rb_persist_node* rb_persist_find(const struct rb_persist_tree* tree, const void* key, size_t len){
+
+	const struct rb_persist_node* node = tree->root;
+	int cmp;
+
+	while (node != NULL){
+		cmp = rb_persist_compare(tree, key, len, node);
+		if (cmp == 0)
+			return node;
+		node = node->link[cmp > 0];
+	}
+	return NULL;
+}
+
+
+extern const void* rb_persist_key(const struct rb_persist_node* node){
+
+	return node->key;
+}
+
+
+extern size_t rb_persist_walk(const struct rb_persist_tree* tree,
+			      bool (*visit)(const struct rb_persist_node*, void*), void* ctx){
+
+	const struct rb_persist_node* stack[RB_ITER_MAX_DEPTH];
+	const struct rb_persist_node* node = tree->root;
+	size_t visited = 0;
+	int depth = 0;
+
+	while (node != NULL || depth > 0){
+		while (node != NULL){
+			stack[depth++] = node;
+			node = node->link[0];
+		}
+		node = stack[--depth];
+		visited++;
+		if (!visit(node, ctx))
+			break;
+		node = node->link[1];
+	}
+	return visited;
+}
@@ -0,0 +1,69 @@
+/*
+   Persistent (copy-on-write) left-leaning red black tree.
+
+   Nodes have no parent pointers and are reference counted, so any number of
+   versions can share them. rb_snapshot hands out a new version in O(1) by
+   taking a reference to the root; after that, an insert or delete copies only
+   the nodes on its path (O(log n) of them) and leaves every other version as
+   it was. Nodes no version can reach any more are freed as soon as their
+   count drops to zero. While nothing shares a node, updates change it in
+   place and allocate nothing beyond the inserted node.
+
+   Every version is a tree of its own: it can be searched, walked, updated
+   (which forks it) and destroyed in any order. Updates and rb_snapshot of one
+   version must not run concurrently with each other, but with GCC or clang the
+   counts are atomic, so other threads may search, walk and destroy snapshots
+   while the writer keeps going. A node reached from a version never changes.
+
+   Keys use the same types and comparators as rbtree.h and are copied into the
+   node. Data pointers are stored as given and never freed by the tree.
+
+   Based on Sedgewick's left-leaning red black trees (2008).
+*/
+#ifndef RBTREE_PERSIST_H
+#define RBTREE_PERSIST_H
+
+#include "rbtree.h"
+
+struct rb_persist_node{
+	struct rb_persist_node* link[2];	/* left, right */
+	uint32_t refs;		/* links and versions pointing here */
+	uint32_t red;
+	void* data;
+	size_t key_len;
+	uint64_t key[];		/* key_len bytes and a terminator */
+};
+
+struct rb_persist_tree{
+	struct rb_persist_node* root;
+	size_t count;
+	unsigned int keyType;
+	rb_compare_fn compare;
+	size_t key_size;
+};
+
+/* Only key_type and compare are read from the options; NULL means string keys. */
+extern struct rb_persist_tree* rb_persist_alloc(const struct rb_tree_options*);
+
+/* Drops this version; nodes shared with other versions stay until they go too. */
+extern void rb_persist_destroy(struct rb_persist_tree*);
+
+/* A new version holding the tree's current contents, in O(1). */
+extern struct rb_persist_tree* rb_snapshot(struct rb_persist_tree*);
+
+/* Inserts key with data, or replaces the data if key is present.
+   Returns true if the key is new. Other versions do not see the change. */
+extern bool rb_persist_insert(struct rb_persist_tree*, const void*, size_t, void*);
+
+/* Removes key. Returns false if it was not present. */
+extern bool rb_persist_delete(struct rb_persist_tree*, const void*, size_t);
+
+extern const struct rb_persist_node* rb_persist_find(const struct rb_persist_tree*, const void*, size_t);
+
+extern const void* rb_persist_key(const struct rb_persist_node*);
+
+/* Visits every node in key order; the callback returns false to stop.
+   Returns the number of nodes visited. */
+extern size_t rb_persist_walk(const struct rb_persist_tree*, bool (*)(const struct rb_persist_node*, void*), void*);
+
+#endif
@@ -0,0 +1,347 @@
+/*
+   Top-down red black tree; see rbtree_topdown.h.
+
+   Both link words carry a flag in bit 0, so every child read masks it off and
+   every child write keeps it. The false head node used by insert and delete
+   stands in for a parent of the root, which is what lets both operations finish
+   in a single pass from the root without parent pointers or a stack.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "rbtree_topdown.h"
+
+#define RB_TD_FLAG ((uintptr_t) 1)
+
+static inline struct rb_td_node* rb_td_link(const struct rb_td_node* node, int dir){
+
+	return (struct rb_td_node*) (node->link[dir] & ~RB_TD_FLAG);
+}
+
+
+static inline void rb_td_set_link(struct rb_td_node* node, int dir, struct rb_td_node* child){
+
+	node->link[dir] = (uintptr_t) child | (node->link[dir] & RB_TD_FLAG);
+}
+
+
+static inline bool rb_td_red(const struct rb_td_node* node){
+
+	return node != NULL && (node->link[0] & RB_TD_FLAG);
+}
+
+
+static inline void rb_td_set_red(struct rb_td_node* node, bool red){
+
+	node->link[0] = (node->link[0] & ~RB_TD_FLAG) | (red ? RB_TD_FLAG : 0);
+}
+
+
+static inline bool rb_td_heap_key(const struct rb_td_node* node){
+
+	return (node->link[1] & RB_TD_FLAG) != 0;
+}
+
+
+static inline int rb_td_compare(struct rb_td_tree* tree, struct rb_td_node* node, const void* key, size_t len){
+
+	return rb_compare_keys(tree->keyType, tree->compare, rb_td_key(node), node->key_len, key, len);
+}
+
+
+static struct rb_td_node* rb_td_node_alloc(struct rb_td_tree* tree, const void* key, size_t len, void* data){
+
+	struct rb_td_node* node = (struct rb_td_node*) malloc(sizeof(struct rb_td_node));
+	node->link[0] = RB_TD_FLAG;	/* red */
+	node->link[1] = 0;
+	node->key.word = 0;
+	node->data = data;
+	node->key_len = len;
+
+	/* Strings keep their terminator, so only 7 characters fit inline. */
+	if (len < sizeof(node->key) || (tree->key_size == len && len == sizeof(node->key))){
+		memcpy(&node->key.word, key, len);
+	}else{
+		char* copy = malloc(len + 1);
+		memcpy(copy, key, len);
+		copy[len] = '\0';
+		node->key.ptr = copy;
+		node->link[1] = RB_TD_FLAG;
+	}
+	return node;
+}
+
+
+static void rb_td_node_free(struct rb_td_node* node){
+
+	if (rb_td_heap_key(node))
+		free(node->key.ptr);
+	free(node);
+}
+
+
+static struct rb_td_node* rb_td_single(struct rb_td_node* root, int dir){
+
+	struct rb_td_node* save = rb_td_link(root, !dir);
+
+	rb_td_set_link(root, !dir, rb_td_link(save, dir));
+	rb_td_set_link(save, dir, root);
+	rb_td_set_red(root, true);
+	rb_td_set_red(save, false);
+	return save;
+}
+
+
+static struct rb_td_node* rb_td_double(struct rb_td_node* root, int dir){
+
+	rb_td_set_link(root, !dir, rb_td_single(rb_td_link(root, !dir), !dir));
+	return rb_td_single(root, dir);
+}
+
+
+extern struct rb_td_tree* rb_td_alloc(const struct rb_tree_options* options){
+
+	struct rb_td_tree* tree = (struct rb_td_tree*) malloc(sizeof(struct rb_td_tree));
+	memset(tree, 0, sizeof(*tree));
+	tree->keyType = rb_key_type_resolve(options != NULL ? options->key_type : RB_KEY_STRING,
+					    options != NULL ? options->compare : NULL,
+					    &tree->compare, &tree->key_size);
+	if (tree->compare == NULL){
+		free(tree);
+		return NULL;
+	}
+	return tree;
+}
+
+
+/* Rotates every left child up until the tree is a right spine, freeing nodes as
+   they lose their left subtree. Constant space, no recursion. */
+extern void rb_td_destroy(struct rb_td_tree* tree){
+
+	struct rb_td_node* node = tree->root;
+	struct rb_td_node* next;
+
+	while (node != NULL){
+		next = rb_td_link(node, 0);
+		if (next == NULL){
+			next = rb_td_link(node, 1);
+			rb_td_node_free(node);
+		}else{
+			rb_td_set_link(node, 0, rb_td_link(next, 1));
+			rb_td_set_link(next, 1, node);
+		}
+		node = next;
+	}
+	free(tree);
+}
+
+
+extern struct rb_td_node* rb_td_insert(struct rb_td_tree* tree, const void* key, size_t len, void* data, bool* inserted){
+
+	struct rb_td_node head;
+	struct rb_td_node *g, *t, *p, *q;
+	struct rb_td_node* found = NULL;
+	int dir = 0, last = 0, cmp;
+
+	if (inserted != NULL)
+		*inserted = false;
+
+	if (tree->root == NULL){
+		found = tree->root = rb_td_node_alloc(tree, key, len, data);
+		rb_td_set_red(tree->root, false);
+		tree->count++;
+		if (inserted != NULL)
+			*inserted = true;
+		return found;
+	}
+
+	memset(&head, 0, sizeof(head));
+	t = &head;
+	g = p = NULL;
+	q = tree->root;
+	rb_td_set_link(t, 1, q);
+
+	for (;;){
+		if (q == NULL){
+			q = rb_td_node_alloc(tree, key, len, data);
+			rb_td_set_link(p, dir, q);
+			tree->count++;
+			if (inserted != NULL)
+				*inserted = true;
+		}else if (rb_td_red(rb_td_link(q, 0)) && rb_td_red(rb_td_link(q, 1))){
+			rb_td_set_red(q, true);
+			rb_td_set_red(rb_td_link(q, 0), false);
+			rb_td_set_red(rb_td_link(q, 1), false);
+		}
+
+		/* Red q under red p: rotate at the grandparent, seen through t. */
+		if (rb_td_red(q) && rb_td_red(p)){
+			int dir2 = rb_td_link(t, 1) == g;
+
+			if (q == rb_td_link(p, last))
+				rb_td_set_link(t, dir2, rb_td_single(g, !last));
+			else
+				rb_td_set_link(t, dir2, rb_td_double(g, !last));
+		}
+
+		cmp = rb_td_compare(tree, q, key, len);
+		if (cmp == 0){
+			found = q;
+			break;
+		}
+
+		last = dir;
+		dir = cmp < 0;
+
+		if (g != NULL)
+			t = g;
+		g = p;
+		p = q;
+		q = rb_td_link(q, dir);
+	}
+
+	tree->root = rb_td_link(&head, 1);
+	rb_td_set_red(tree->root, false);
+	return found;
+}
+
+
+extern struct rb_td_node* rb_td_find(struct rb_td_tree* tree, const void* key, size_t len){
+
+	struct rb_td_node* node = tree->root;
+	int cmp;
+
+	while (node != NULL){
+		cmp = rb_td_compare(tree, node, key, len);
+		if (cmp == 0)
+			return node;
+		node = rb_td_link(node, cmp < 0);
+	}
+	return NULL;
+}
+
+
+/* Pushes a red node down the search path so the node finally unlinked is red,
+   then copies the in-order neighbour found at the bottom into the matched node. */
+extern bool rb_td_delete(struct rb_td_tree* tree, const void* key, size_t len){
+
+	struct rb_td_node head;
+	struct rb_td_node *q, *p, *g, *s;
+	struct rb_td_node* f = NULL;
+	int dir = 1, last, cmp;
+
+	if (tree->root == NULL)
+		return false;
+
+	memset(&head, 0, sizeof(head));
+	q = &head;
+	g = p = NULL;
+	rb_td_set_link(q, 1, tree->root);
+
+	while (rb_td_link(q, dir) != NULL){
+		last = dir;
+		g = p;
+		p = q;
+		q = rb_td_link(q, dir);
+		cmp = rb_td_compare(tree, q, key, len);
+		dir = cmp < 0;
+
+		if (cmp == 0)
+			f = q;
+
+		if (rb_td_red(q) || rb_td_red(rb_td_link(q, dir)))
+			continue;
+
+		if (rb_td_red(rb_td_link(q, !dir))){
+			rb_td_set_link(p, last, rb_td_single(q, dir));
+			p = rb_td_link(p, last);
+		}else{
+			s = rb_td_link(p, !last);
+			if (s == NULL)
+				continue;
+
+			if (!rb_td_red(rb_td_link(s, !last)) && !rb_td_red(rb_td_link(s, last))){
+				/* Colour flip */
+				rb_td_set_red(p, false);
+				rb_td_set_red(s, true);
+				rb_td_set_red(q, true);
+			}else{
+				int dir2 = rb_td_link(g, 1) == p;
+				struct rb_td_node* top;
+
+				if (rb_td_red(rb_td_link(s, last)))
+					rb_td_set_link(g, dir2, rb_td_double(p, last));
+				else
+					rb_td_set_link(g, dir2, rb_td_single(p, last));
+
+				top = rb_td_link(g, dir2);
+				rb_td_set_red(q, true);
+				rb_td_set_red(top, true);
+				rb_td_set_red(rb_td_link(top, 0), false);
+				rb_td_set_red(rb_td_link(top, 1), false);
+			}
+		}
+	}
+
+	if (f != NULL){
+		if (f != q){
+			/* f takes over q's key and data, including the heap flag. */
+			if (rb_td_heap_key(f))
+				free(f->key.ptr);
+			f->key = q->key;
+			f->key_len = q->key_len;
+			f->data = q->data;
+			f->link[1] = (f->link[1] & ~RB_TD_FLAG) | (q->link[1] & RB_TD_FLAG);
+			q->link[1] &= ~RB_TD_FLAG;
+		}
+		rb_td_set_link(p, rb_td_link(p, 1) == q, rb_td_link(q, rb_td_link(q, 0) == NULL));
+		rb_td_node_free(q);
+		tree->count--;
+	}
+
+	tree->root = rb_td_link(&head, 1);
+	if (tree->root != NULL)
+		rb_td_set_red(tree->root, false);
+	return f != NULL;
+}
+
+
+extern const void* rb_td_key(const struct rb_td_node* node){
+
+	return rb_td_heap_key(node) ? node->key.ptr : (const void*) &node->key.word;
+}
+
+
+extern struct rb_td_node* rb_td_child(const struct rb_td_node* node, int dir){
+
+	return rb_td_link(node, dir != 0);
+}
+
+
+extern bool rb_td_is_red(const struct rb_td_node* node){
+
+	return rb_td_red(node);
+}
+
+
+/* The height of a red black tree is at most 2 log2(n + 1), so the stack can
+   not overflow for any tree that fits in memory. */
+extern size_t rb_td_walk(struct rb_td_tree* tree, bool (*visit)(struct rb_td_node*, void*), void* ctx){
+
+	struct rb_td_node* stack[RB_ITER_MAX_DEPTH];
+	struct rb_td_node* node = tree->root;
+	size_t visited = 0;
+	int depth = 0;
+
+	while (node != NULL || depth > 0){
+		while (node != NULL){
+			stack[depth++] = node;
+			node = rb_td_link(node, 0);
+		}
+		node = stack[--depth];
+		visited++;
+		if (!visit(node, ctx))
+			break;
+		node = rb_td_link(node, 1);
+	}
+	return visited;
+}
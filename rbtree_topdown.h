@@ -0,0 +1,66 @@
+/*
+   Top-down red black tree without parent pointers.
+
+   Insertion and deletion rebalance on the way down (colour flips and rotations
+   ahead of the descent), so nothing ever walks back up and nodes need no parent
+   link. The colour lives in bit 0 of the left child link and a "key is on the
+   heap" flag in bit 0 of the right one. A node is 40 bytes on 64-bit builds:
+   two links, the key, the data pointer and the key length. Numeric keys and
+   strings of up to 7 characters are stored in the key word itself; longer keys
+   are copied to the heap.
+
+   Keys use the same types and comparators as rbtree.h. Data pointers are stored
+   as given and never freed by the tree.
+
+   Based on the top-down algorithms of Guibas and Sedgewick as popularised by
+   Julienne Walker's tutorial.
+*/
+#ifndef RBTREE_TOPDOWN_H
+#define RBTREE_TOPDOWN_H
+
+#include "rbtree.h"
+
+struct rb_td_node{
+	uintptr_t link[2];	/* left, right; bit 0: red (link[0]), heap key (link[1]) */
+	union{
+		void* ptr;
+		uint64_t word;
+	} key;
+	void* data;
+	size_t key_len;
+};
+
+struct rb_td_tree{
+	struct rb_td_node* root;
+	size_t count;
+	unsigned int keyType;
+	rb_compare_fn compare;
+	size_t key_size;
+};
+
+/* Only key_type and compare are read from the options; NULL means string keys. */
+extern struct rb_td_tree* rb_td_alloc(const struct rb_tree_options*);
+
+extern void rb_td_destroy(struct rb_td_tree*);
+
+/* Inserts key with data unless it is present. Returns the node holding key;
+   *inserted (when not NULL) tells whether it is new. */
+extern struct rb_td_node* rb_td_insert(struct rb_td_tree*, const void*, size_t, void*, bool*);
+
+extern struct rb_td_node* rb_td_find(struct rb_td_tree*, const void*, size_t);
+
+/* Removes key. Returns false if it was not present. */
+extern bool rb_td_delete(struct rb_td_tree*, const void*, size_t);
+
+extern const void* rb_td_key(const struct rb_td_node*);
+
+/* Child 0 (left) or 1 (right), NULL for a leaf. */
+extern struct rb_td_node* rb_td_child(const struct rb_td_node*, int);
+
+extern bool rb_td_is_red(const struct rb_td_node*);
+
+/* Visits every node in key order; the callback returns false to stop.
+   Returns the number of nodes visited. */
+extern size_t rb_td_walk(struct rb_td_tree*, bool (*)(struct rb_td_node*, void*), void*);
+
+#endif
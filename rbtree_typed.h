@@ -0,0 +1,369 @@
+/*
+   Type-specialised red black trees, generated by macro.
+
+   RB_TREE_DEFINE(name, key_t, val_t, cmp) defines struct name (the tree) and
+   struct name##_node, with keys and values stored by value in the node, plus
+   static inline operations on them:
+
+     name##_init, name##_find, name##_insert, name##_remove, name##_erase,
+     name##_first, name##_last, name##_next, name##_prev, name##_clear
+
+   cmp(a, b) takes two key_t by value and returns <0, 0 or >0. It is expanded
+   at every call site, so a macro or static inline function is inlined into the
+   descent loops; RB_CMP_SCALAR covers arithmetic keys. For example:
+
+     RB_TREE_DEFINE(id_index, int64_t, void*, RB_CMP_SCALAR)
+
+   Same algorithms as rbtree.c (CLRS 3rd edition). Each tree embeds its own
+   sentinel, so leaf checks compare against an address inside the tree and
+   trees share no state. Because of that a tree must not be moved after
+   name##_init.
+*/
+#ifndef RBTREE_TYPED_H
+#define RBTREE_TYPED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define RB_TYPED_BLACK 0
+#define RB_TYPED_RED 1
+
+#define RB_CMP_SCALAR(a, b) (((a) > (b)) - ((a) < (b)))
+
+#define RB_TREE_DEFINE(name, key_t, val_t, cmp)                                                              \
+struct name##_node{                                                                                          \
+	struct name##_node* parent;                                                                          \
+	struct name##_node* left;                                                                            \
+	struct name##_node* right;                                                                           \
+	key_t key;                                                                                           \
+	val_t value;                                                                                         \
+	unsigned char color;                                                                                 \
+};                                                                                                           \
+                                                                                                             \
+struct name{                                                                                                 \
+	struct name##_node* root;                                                                            \
+	struct name##_node nil;                                                                              \
+	size_t count;                                                                                        \
+};                                                                                                           \
+                                                                                                             \
+static inline void name##_init(struct name* tree){                                                           \
+	tree->nil.parent = tree->nil.left = tree->nil.right = &tree->nil;                                    \
+	tree->nil.color = RB_TYPED_BLACK;                                                                    \
+	tree->root = &tree->nil;                                                                             \
+	tree->count = 0;                                                                                     \
+}                                                                                                            \
+                                                                                                             \
+static inline struct name##_node* name##_find(struct name* tree, key_t key){                                 \
+	struct name##_node* node = tree->root;                                                               \
+	int c;                                                                                               \
+	while (node != &tree->nil){                                                                          \
+		c = cmp(key, node->key);                                                                     \
+		if (c == 0)                                                                                  \
+			return node;                                                                         \
+		node = (c < 0) ? node->left : node->right;                                                   \
+	}                                                                                                    \
+	return NULL;                                                                                         \
+}                                                                                                            \
+                                                                                                             \
+static inline struct name##_node* name##_first(struct name* tree){                                           \
+	struct name##_node* node = tree->root;                                                               \
+	if (node == &tree->nil)                                                                              \
+		return NULL;                                                                                 \
+	while (node->left != &tree->nil)                                                                     \
+		node = node->left;                                                                           \
+	return node;                                                                                         \
+}                                                                                                            \
+                                                                                                             \
+static inline struct name##_node* name##_last(struct name* tree){                                            \
+	struct name##_node* node = tree->root;                                                               \
+	if (node == &tree->nil)                                                                              \
+		return NULL;                                                                                 \
+	while (node->right != &tree->nil)                                                                    \
+		node = node->right;                                                                          \
+	return node;                                                                                         \
+}                                                                                                            \
+                                                                                                             \
+static inline struct name##_node* name##_next(struct name* tree, struct name##_node* node){                  \
+	struct name##_node* y;                                                                               \
+	if (node->right != &tree->nil){                                                                      \
+		node = node->right;                                                                          \
+		while (node->left != &tree->nil)                                                             \
+			node = node->left;                                                                   \
+		return node;                                                                                 \
+	}                                                                                                    \
+	y = node->parent;                                                                                    \
+	while (y != &tree->nil && node == y->right){                                                         \
+		node = y;                                                                                    \
+		y = y->parent;                                                                               \
+	}                                                                                                    \
+	return (y == &tree->nil) ? NULL : y;                                                                 \
+}                                                                                                            \
+                                                                                                             \
+static inline struct name##_node* name##_prev(struct name* tree, struct name##_node* node){                  \
+	struct name##_node* y;                                                                               \
+	if (node->left != &tree->nil){                                                                       \
+		node = node->left;                                                                           \
+		while (node->right != &tree->nil)                                                            \
+			node = node->right;                                                                  \
+		return node;                                                                                 \
+	}                                                                                                    \
+	y = node->parent;                                                                                    \
+	while (y != &tree->nil && node == y->left){                                                          \
+		node = y;                                                                                    \
+		y = y->parent;                                                                               \
+	}                                                                                                    \
+	return (y == &tree->nil) ? NULL : y;                                                                 \
+}                                                                                                            \
+                                                                                                             \
+static inline void name##_rotate(struct name* tree, struct name##_node* x, int to_left){                     \
+	struct name##_node* y = to_left ? x->right : x->left;                                                \
+	if (to_left){                                                                                        \
+		x->right = y->left;                                                                          \
+		if (y->left != &tree->nil)                                                                   \
+			y->left->parent = x;                                                                 \
+	}                                                                                                    \
+	else {                                                                                               \
+		x->left = y->right;                                                                          \
+		if (y->right != &tree->nil)                                                                  \
+			y->right->parent = x;                                                                \
+	}                                                                                                    \
+	y->parent = x->parent;                                                                               \
+	if (x->parent == &tree->nil)                                                                         \
+		tree->root = y;                                                                              \
+	else if (x == x->parent->left)                                                                       \
+		x->parent->left = y;                                                                         \
+	else                                                                                                 \
+		x->parent->right = y;                                                                        \
+	if (to_left)                                                                                         \
+		y->left = x;                                                                                 \
+	else                                                                                                 \
+		y->right = x;                                                                                \
+	x->parent = y;                                                                                       \
+}                                                                                                            \
+                                                                                                             \
+static inline void name##_insert_fixup(struct name* tree, struct name##_node* node){                         \
+	struct name##_node* y;                                                                               \
+	while (node->parent->color == RB_TYPED_RED){                                                         \
+		if (node->parent == node->parent->parent->left){                                             \
+			y = node->parent->parent->right;                                                     \
+			if (y->color == RB_TYPED_RED){                                                       \
+				node->parent->color = RB_TYPED_BLACK;                                        \
+				y->color = RB_TYPED_BLACK;                                                   \
+				node->parent->parent->color = RB_TYPED_RED;                                  \
+				node = node->parent->parent;                                                 \
+			}                                                                                    \
+			else {                                                                               \
+				if (node == node->parent->right){                                            \
+					node = node->parent;                                                 \
+					name##_rotate(tree, node, 1);                                        \
+				}                                                                            \
+				node->parent->color = RB_TYPED_BLACK;                                        \
+				node->parent->parent->color = RB_TYPED_RED;                                  \
+				name##_rotate(tree, node->parent->parent, 0);                                \
+			}                                                                                    \
+		}                                                                                            \
+		else {                                                                                       \
+			y = node->parent->parent->left;                                                      \
+			if (y->color == RB_TYPED_RED){                                                       \
+				node->parent->color = RB_TYPED_BLACK;                                        \
+				y->color = RB_TYPED_BLACK;                                                   \
+				node->parent->parent->color = RB_TYPED_RED;                                  \
+				node = node->parent->parent;                                                 \
+			}                                                                                    \
+			else {                                                                               \
+				if (node == node->parent->left){                                             \
+					node = node->parent;                                                 \
+					name##_rotate(tree, node, 0);                                        \
+				}                                                                            \
+				node->parent->color = RB_TYPED_BLACK;                                        \
+				node->parent->parent->color = RB_TYPED_RED;                                  \
+				name##_rotate(tree, node->parent->parent, 1);                                \
+			}                                                                                    \
+		}                                                                                            \
+	}                                                                                                    \
+	tree->root->color = RB_TYPED_BLACK;                                                                  \
+}                                                                                                            \
+                                                                                                             \
+/* Inserts key unless it is already present. Returns the node holding key either way;                        \
+   an existing node keeps its value. *inserted (when not NULL) tells which happened. */                      \
+static inline struct name##_node* name##_insert(struct name* tree, key_t key, val_t value, bool* inserted){  \
+	struct name##_node* y = &tree->nil;                                                                  \
+	struct name##_node* x = tree->root;                                                                  \
+	struct name##_node* node;                                                                            \
+	int c = 0;                                                                                           \
+	while (x != &tree->nil){                                                                             \
+		y = x;                                                                                       \
+		c = cmp(key, x->key);                                                                        \
+		if (c == 0){                                                                                 \
+			if (inserted)                                                                        \
+				*inserted = false;                                                           \
+			return x;                                                                            \
+		}                                                                                            \
+		x = (c < 0) ? x->left : x->right;                                                            \
+	}                                                                                                    \
+	node = (struct name##_node*) malloc(sizeof(struct name##_node));                                     \
+	if (node == NULL)                                                                                    \
+		return NULL;                                                                                 \
+	node->key = key;                                                                                     \
+	node->value = value;                                                                                 \
+	node->parent = y;                                                                                    \
+	node->left = node->right = &tree->nil;                                                               \
+	node->color = RB_TYPED_RED;                                                                          \
+	if (y == &tree->nil)                                                                                 \
+		tree->root = node;                                                                           \
+	else if (c < 0)                                                                                      \
+		y->left = node;                                                                              \
+	else                                                                                                 \
+		y->right = node;                                                                             \
+	tree->count++;                                                                                       \
+	name##_insert_fixup(tree, node);                                                                     \
+	if (inserted)                                                                                        \
+		*inserted = true;                                                                            \
+	return node;                                                                                         \
+}                                                                                                            \
+                                                                                                             \
+static inline void name##_transplant(struct name* tree, struct name##_node* u, struct name##_node* v){       \
+	if (u->parent == &tree->nil)                                                                         \
+		tree->root = v;                                                                              \
+	else if (u == u->parent->left)                                                                       \
+		u->parent->left = v;                                                                         \
+	else                                                                                                 \
+		u->parent->right = v;                                                                        \
+	v->parent = u->parent;                                                                               \
+}                                                                                                            \
+                                                                                                             \
+static inline void name##_delete_fixup(struct name* tree, struct name##_node* x){                            \
+	struct name##_node* w;                                                                               \
+	while (x != tree->root && x->color == RB_TYPED_BLACK){                                               \
+		if (x == x->parent->left){                                                                   \
+			w = x->parent->right;                                                                \
+			if (w->color == RB_TYPED_RED){                                                       \
+				w->color = RB_TYPED_BLACK;                                                   \
+				x->parent->color = RB_TYPED_RED;                                             \
+				name##_rotate(tree, x->parent, 1);                                           \
+				w = x->parent->right;                                                        \
+			}                                                                                    \
+			if (w->left->color == RB_TYPED_BLACK && w->right->color == RB_TYPED_BLACK){          \
+				w->color = RB_TYPED_RED;                                                     \
+				x = x->parent;                                                               \
+			}                                                                                    \
+			else {                                                                               \
+				if (w->right->color == RB_TYPED_BLACK){                                      \
+					w->left->color = RB_TYPED_BLACK;                                     \
+					w->color = RB_TYPED_RED;                                             \
+					name##_rotate(tree, w, 0);                                           \
+					w = x->parent->right;                                                \
+				}                                                                            \
+				w->color = x->parent->color;                                                 \
+				x->parent->color = RB_TYPED_BLACK;                                           \
+				w->right->color = RB_TYPED_BLACK;                                            \
+				name##_rotate(tree, x->parent, 1);                                           \
+				x = tree->root;                                                              \
+			}                                                                                    \
+		}                                                                                            \
+		else {                                                                                       \
+			w = x->parent->left;                                                                 \
+			if (w->color == RB_TYPED_RED){                                                       \
+				w->color = RB_TYPED_BLACK;                                                   \
+				x->parent->color = RB_TYPED_RED;                                             \
+				name##_rotate(tree, x->parent, 0);                                           \
+				w = x->parent->left;                                                         \
+			}                                                                                    \
+			if (w->left->color == RB_TYPED_BLACK && w->right->color == RB_TYPED_BLACK){          \
+				w->color = RB_TYPED_RED;                                                     \
+				x = x->parent;                                                               \
+			}                                                                                    \
+			else {                                                                               \
+				if (w->left->color == RB_TYPED_BLACK){                                       \
+					w->right->color = RB_TYPED_BLACK;                                    \
+					w->color = RB_TYPED_RED;                                             \
+					name##_rotate(tree, w, 1);                                           \
+					w = x->parent->left;                                                 \
+				}                                                                            \
+				w->color = x->parent->color;                                                 \
+				x->parent->color = RB_TYPED_BLACK;                                           \
+				w->left->color = RB_TYPED_BLACK;                                             \
+				name##_rotate(tree, x->parent, 0);                                           \
+				x = tree->root;                                                              \
+			}                                                                                    \
+		}                                                                                            \
+	}                                                                                                    \
+	x->color = RB_TYPED_BLACK;                                                                           \
+}                                                                                                            \
+                                                                                                             \
+/* Unlinks and frees node. */                                                                                \
+static inline void name##_erase(struct name* tree, struct name##_node* node){                                \
+	struct name##_node* x;                                                                               \
+	struct name##_node* y = node;                                                                        \
+	unsigned char y_original_color = y->color;                                                           \
+	if (node->left == &tree->nil){                                                                       \
+		x = node->right;                                                                             \
+		name##_transplant(tree, node, node->right);                                                  \
+	}                                                                                                    \
+	else if (node->right == &tree->nil){                                                                 \
+		x = node->left;                                                                              \
+		name##_transplant(tree, node, node->left);                                                   \
+	}                                                                                                    \
+	else {                                                                                               \
+		y = node->right;                                                                             \
+		while (y->left != &tree->nil)                                                                \
+			y = y->left;                                                                         \
+		y_original_color = y->color;                                                                 \
+		x = y->right;                                                                                \
+		if (y->parent == node){                                                                      \
+			x->parent = y;                                                                       \
+		}                                                                                            \
+		else {                                                                                       \
+			name##_transplant(tree, y, y->right);                                                \
+			y->right = node->right;                                                              \
+			y->right->parent = y;                                                                \
+		}                                                                                            \
+		name##_transplant(tree, node, y);                                                            \
+		y->left = node->left;                                                                        \
+		y->left->parent = y;                                                                         \
+		y->color = node->color;                                                                      \
+	}                                                                                                    \
+	if (y_original_color == RB_TYPED_BLACK)                                                              \
+		name##_delete_fixup(tree, x);                                                                \
+	tree->nil.parent = &tree->nil;                                                                       \
+	tree->count--;                                                                                       \
+	free(node);                                                                                          \
+}                                                                                                            \
+                                                                                                             \
+static inline bool name##_remove(struct name* tree, key_t key){                                              \
+	struct name##_node* node = name##_find(tree, key);                                                   \
+	if (node == NULL)                                                                                    \
+		return false;                                                                                \
+	name##_erase(tree, node);                                                                            \
+	return true;                                                                                         \
+}                                                                                                            \
+                                                                                                             \
+/* Frees every node; the tree is left empty and reusable. */                                                 \
+static inline void name##_clear(struct name* tree){                                                          \
+	struct name##_node* node = tree->root;                                                               \
+	struct name##_node* parent;                                                                          \
+	while (node != &tree->nil){                                                                          \
+		if (node->left != &tree->nil){                                                               \
+			node = node->left;                                                                   \
+		}                                                                                            \
+		else if (node->right != &tree->nil){                                                         \
+			node = node->right;                                                                  \
+		}                                                                                            \
+		else {                                                                                       \
+			parent = node->parent;                                                               \
+			if (parent != &tree->nil){                                                           \
+				if (parent->left == node)                                                    \
+					parent->left = &tree->nil;                                           \
+				else                                                                         \
+					parent->right = &tree->nil;                                          \
+			}                                                                                    \
+			free(node);                                                                          \
+			node = parent;                                                                       \
+		}                                                                                            \
+	}                                                                                                    \
+	tree->root = &tree->nil;                                                                             \
+	tree->count = 0;                                                                                     \
+}
+
+#endif
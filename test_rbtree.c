@@ -1,12 +1,88 @@
 #include "rbtree.h"
+#include "rbtree_typed.h"
+#include "rbtree_topdown.h"
+#include "rbtree_arena.h"
+#include "rbtree_persist.h"
 #include "unity.h"
 #include <string.h>
+#include <stdlib.h>
+
+RB_TREE_DEFINE(id_index, int64_t, void*, RB_CMP_SCALAR)
+
+/* How shape_black_height walks one tree engine: child links (NULL past a
+   leaf) and colour, read through the engine's own accessors. */
+struct rb_shape{
+	const void *(*child)(const void *tree, const void *node, int dir);
+	bool (*red)(const void *tree, const void *node);
+	bool left_leaning;	/* red links may only lean left */
+	const void *tree;
+};
+
+static bool shape_red(const struct rb_shape *shape, const void *node){
+	return node != NULL && shape->red(shape->tree, node);
+}
+
+/* Black height of the subtree, or -1 if it breaks a red black property. */
+static int shape_black_height(const struct rb_shape *shape, const void *node){
+	const void *left_child, *right_child;
+	int left, right;
+
+	if (node == NULL)
+		return 1;
+	left_child = shape->child(shape->tree, node, 0);
+	right_child = shape->child(shape->tree, node, 1);
+	if (shape_red(shape, node) && (shape_red(shape, left_child) || shape_red(shape, right_child)))
+		return -1;
+	if (shape->left_leaning && shape_red(shape, right_child))
+		return -1;
+	left = shape_black_height(shape, left_child);
+	right = shape_black_height(shape, right_child);
+	if (left < 0 || left != right)
+		return -1;
+	return left + !shape_red(shape, node);
+}
+
+static const void *node_child(const void *tree, const void *node, int dir){
+	const struct rb_node *child = dir ? ((const struct rb_node*) node)->right : ((const struct rb_node*) node)->left;
+
+	(void) tree;
+	return child == RB_NIL ? NULL : child;
+}
+
+static bool node_red(const void *tree, const void *node){
+	(void) tree;
+	return rb_color((const struct rb_node*) node) == 1;
+}
+
+static int black_height(struct rb_node *node){
+	static const struct rb_shape shape = {node_child, node_red, false, NULL};
+
+	return shape_black_height(&shape, node == RB_NIL ? NULL : node);
+}
+
+static const void *td_child(const void *tree, const void *node, int dir){
+	(void) tree;
+	return rb_td_child(node, dir);
+}
+
+static bool td_red(const void *tree, const void *node){
+	(void) tree;
+	return rb_td_is_red(node);
+}
+
+static const struct rb_shape td_shape = {td_child, td_red, false, NULL};
+
+/* 7919 is prime, so i = 0..n-1 visits every key in 0..n-1 in scrambled order. */
+static int64_t scrambled(int64_t i, int64_t n){
+	return i * 7919 % n;
+}
 
 void test_rbtree_alloc(){
 	struct rb_tree *tree = rb_tree_alloc();
 	TEST_ASSERT_EQUAL_STRING(tree->root->key, "NIL");
-	TEST_ASSERT_EQUAL(tree->root->color, 0);
-	TEST_ASSERT_EQUAL(tree->root->parent, NULL);
+	TEST_ASSERT_EQUAL(rb_color(tree->root), 0);
+	TEST_ASSERT_EQUAL(rb_parent(tree->root), NULL);
+	rb_tree_destroy(tree, NULL, NULL);
 }
 
 void test_insert_and_retrieve(){
@@ -28,6 +104,7 @@ void test_insert_and_retrieve(){
 		TEST_ASSERT_EQUAL_STRING(node->key, s);
 		TEST_ASSERT_EQUAL_STRING(node->data, s);
 	}
+	rb_tree_destroy(tree, NULL, NULL);
 }
 
 
@@ -49,6 +126,7 @@ void test_check_ordering(){
 		s[0] = c;
 		TEST_ASSERT_EQUAL_STRING(node->key, s);
 	}
+	rb_tree_destroy(tree, NULL, NULL);
 }
 
 
@@ -71,6 +149,7 @@ void test_insert_and_delete(){
 			TEST_ASSERT_EQUAL(node, NULL);
 		}
 	}
+	rb_tree_destroy(tree, NULL, NULL);
 }
 
 void test_a_million_items(){
@@ -97,8 +176,1371 @@ void test_a_million_items(){
 	  sprintf(key, "%d", i);
 	  TEST_ASSERT_EQUAL(delete(tree, key), true);
 	}
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+static size_t released;
+
+static char *copy_string(const char *s){
+	char *copy = malloc(strlen(s) + 1);
+
+	return strcpy(copy, s);
+}
+
+static void count_and_free(void *p){
+	released++;
+	free(p);
+}
+
+void test_destroy_and_clear(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_node *node;
+	char key[40];
+
+	/* Unpooled: the callbacks take over freeing heap keys and all data. */
+	tree = rb_tree_alloc();
+	for(int i = 0; i < 1000; i++){
+		sprintf(key, i % 2 ? "%d" : "a key too long to fit inline %d", i);
+		rb_insert(tree, rb_node_alloc_kv(key, key));
+	}
+	released = 0;
+	rb_tree_clear(tree, count_and_free, count_and_free);
+	TEST_ASSERT_EQUAL(released, 500 + 1000);
+	TEST_ASSERT_EQUAL(tree->root, RB_NIL);
+	TEST_ASSERT_EQUAL(rb_search(tree, "1"), NULL);
+
+	rb_insert(tree, rb_node_alloc_kv("1", "1"));
+	TEST_ASSERT_EQUAL_STRING(rb_search(tree, "1")->data, "1");
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* Pooled: clear keeps a chunk and the tree is usable again. */
+	options.pool_chunk_nodes = 64;
+	tree = rb_tree_alloc_with(&options);
+	for(int round = 0; round < 3; round++){
+		for(int i = 0; i < 1000; i++){
+			sprintf(key, "%d", i);
+			rb_insert(tree, rb_tree_node_alloc_kv(tree, key, key));
+		}
+		node = rb_search(tree, "999");
+		TEST_ASSERT_EQUAL_STRING(node->data, "999");
+		rb_tree_clear(tree, NULL, NULL);
+		TEST_ASSERT_EQUAL(tree->root, RB_NIL);
+	}
+
+	/* Pooled copies live in the chunks, so the callbacks never see them. */
+	for(int i = 0; i < 100; i++){
+		sprintf(key, "a key too long to fit inline %d", i);
+		rb_insert(tree, rb_tree_node_alloc_kv(tree, key, key));
+	}
+	released = 0;
+	rb_tree_destroy(tree, count_and_free, count_and_free);
+	TEST_ASSERT_EQUAL(released, 0);
+
+	/* Taken data is still handed over. */
+	options.data_ownership = RB_TAKE;
+	tree = rb_tree_alloc_with(&options);
+	for(int i = 0; i < 100; i++){
+		sprintf(key, "a key too long to fit inline %d", i);
+		rb_insert(tree, rb_tree_node_alloc_kv(tree, key, copy_string(key)));
+	}
+	released = 0;
+	rb_tree_destroy(tree, count_and_free, count_and_free);
+	TEST_ASSERT_EQUAL(released, 100);
+}
+
+void test_pooled_tree(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_node *node, *freed;
+	char key[10];
+
+	options.pool_chunk_nodes = 64;
+	tree = rb_tree_alloc_with(&options);
+
+	for(int i = 0; i < 10000; i++){
+		sprintf(key, "%d", i);
+		node = rb_tree_node_alloc_kv(tree, key, key);
+		rb_insert(tree, node);
+	}
+	for(int i = 0; i < 10000; i++){
+		sprintf(key, "%d", i);
+		node = rb_search(tree, key);
+		TEST_ASSERT_EQUAL_STRING(node->key, key);
+		TEST_ASSERT_EQUAL_STRING(node->data, key);
+	}
+
+	/* A deleted node is handed out again by the next allocation. */
+	freed = rb_search(tree, "42");
+	TEST_ASSERT_EQUAL(delete(tree, "42"), true);
+	node = rb_tree_node_alloc_kv(tree, "42", "forty-two");
+	TEST_ASSERT_EQUAL_PTR(node, freed);
+	rb_insert(tree, node);
+	TEST_ASSERT_EQUAL_STRING(rb_search(tree, "42")->data, "forty-two");
+
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_destroy_unpooled_tree(){
+	struct rb_tree *tree = rb_tree_alloc();
+	char key[10];
+
+	for(int i = 0; i < 1000; i++){
+		sprintf(key, "%d", i);
+		rb_insert(tree, rb_node_alloc_kv(key, key));
+	}
+	rb_tree_destroy(tree, NULL, NULL);
+
+	tree = rb_tree_alloc();
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_inline_and_long_keys(){
+	struct rb_tree *tree = rb_tree_alloc();
+	struct rb_node *node;
+	char *long_key = "a key that is too long to be stored inline";
+
+	node = rb_node_alloc_kv("123456", "short");
+	TEST_ASSERT_EQUAL_PTR(node->key, node->key_buf);
+	TEST_ASSERT_EQUAL(node->key_len, 6);
+	rb_insert(tree, node);
+
+	node = rb_node_alloc_kv(long_key, "long");
+	TEST_ASSERT_TRUE(node->key != (void*) node->key_buf);
+	TEST_ASSERT_EQUAL(node->key_len, strlen(long_key));
+	rb_insert(tree, node);
+
+	TEST_ASSERT_EQUAL_STRING(rb_search(tree, "123456")->key, "123456");
+	TEST_ASSERT_EQUAL_STRING(rb_search(tree, long_key)->key, long_key);
+	TEST_ASSERT_EQUAL(delete(tree, long_key), true);
+	TEST_ASSERT_EQUAL(delete(tree, "123456"), true);
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_string_compare(){
+	TEST_ASSERT_TRUE(STRING_COMPARE("9", 1, "10", 2) < 0);
+	TEST_ASSERT_TRUE(STRING_COMPARE("ab", 2, "aa", 2) > 0);
+	TEST_ASSERT_EQUAL(STRING_COMPARE("ab", 2, "ab", 2), 0);
+	TEST_ASSERT_TRUE(STRING_LESS_THAN("9", "10"));
+	TEST_ASSERT_FALSE(STRING_NOT_EQUAL("ab", "ab"));
+}
+
+void test_set_and_is_member(){
+	struct rb_tree *tree = rb_tree_alloc();
+	char value[] = "replaced";
+
+	set(tree, "k", "v");
+	TEST_ASSERT_TRUE(is_member(tree, "k"));
+	TEST_ASSERT_FALSE(is_member(tree, "missing"));
+	TEST_ASSERT_EQUAL_STRING(rb_find(tree, "kx", 1)->data, "v");
+	TEST_ASSERT_EQUAL(rb_find(tree, "kx", 2), NULL);
+
+	/* The default tree copies the new value and frees the old one. */
+	set(tree, "k", value);
+	TEST_ASSERT_EQUAL_STRING(rb_search(tree, "k")->data, value);
+	TEST_ASSERT_TRUE(rb_search(tree, "k")->data != value);
+	TEST_ASSERT_EQUAL(delete(tree, "missing"), false);
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_ownership(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_node *node;
+	char long_key[] = "a key that does not fit inline";
+	char short_key[] = "short";
+	char value[] = "borrowed value";
+	char *taken;
+
+	/* Values longer than their keys are copied whole. */
+	node = rb_node_alloc_kv("k", "a longer value");
+	TEST_ASSERT_EQUAL_STRING(node->data, "a longer value");
+	rb_free(node);
+
+	/* Borrowed long keys and data are stored as given and never freed. */
+	options.key_ownership = RB_BORROW;
+	options.data_ownership = RB_BORROW;
+	tree = rb_tree_alloc_with(&options);
+	set(tree, long_key, value);
+	set(tree, short_key, value);
+	node = rb_search(tree, long_key);
+	TEST_ASSERT_EQUAL_PTR(long_key, node->key);
+	TEST_ASSERT_EQUAL_PTR(value, node->data);
+	TEST_ASSERT_TRUE(rb_search(tree, short_key)->key != (void*) short_key);
+	TEST_ASSERT_EQUAL(delete(tree, long_key), true);
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* Taken keys and data are freed by the tree, including replaced values. */
+	options.key_ownership = RB_TAKE;
+	options.data_ownership = RB_TAKE;
+	for(size_t chunk = 0; chunk <= 64; chunk += 64){
+		options.pool_chunk_nodes = chunk;
+		tree = rb_tree_alloc_with(&options);
+		for(int i = 0; i < 100; i++){
+			taken = malloc(40);
+			sprintf(taken, i % 2 ? "%d" : "a key too long to fit inline %d", i);
+			set(tree, taken, copy_string("first"));
+		}
+		set(tree, copy_string("a key too long to fit inline 0"), copy_string("second"));
+		TEST_ASSERT_EQUAL_STRING(rb_search(tree, "a key too long to fit inline 0")->data, "second");
+		TEST_ASSERT_EQUAL(delete(tree, "a key too long to fit inline 2"), true);
+		TEST_ASSERT_EQUAL(delete(tree, "3"), true);
+		rb_tree_destroy(tree, NULL, NULL);
+	}
+}
+
+void test_int64_keys(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_node *node;
+	int64_t k;
+
+	options.key_type = RB_KEY_INT64;
+	tree = rb_tree_alloc_with(&options);
+	for(k = -500; k < 500; k++){
+		rb_insert(tree, rb_tree_node_alloc_kv(tree, (char*) &k, "v"));
+	}
+
+	/* Numeric order, not the string order of the formatted values. */
+	k = -500;
+	node = rb_search(tree, (char*) &k);
+	for(k = -499; k < 500; k++){
+		node = tree_successor(node);
+		TEST_ASSERT_EQUAL_INT64(k, *(int64_t*) node->key);
+	}
+	TEST_ASSERT_EQUAL(tree_successor(node), SENTINEL());
+
+	k = 7;
+	TEST_ASSERT_TRUE(is_member(tree, (char*) &k));
+	TEST_ASSERT_EQUAL(delete(tree, (char*) &k), true);
+	TEST_ASSERT_FALSE(is_member(tree, (char*) &k));
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_other_key_types(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	uint64_t big = UINT64_MAX, small = 1;
+	double d[] = {2.5, -1.0, 0.25};
+
+	options.key_type = RB_KEY_UINT64;
+	tree = rb_tree_alloc_with(&options);
+	set(tree, (char*) &big, "big");
+	set(tree, (char*) &small, "small");
+	TEST_ASSERT_EQUAL_STRING(tree_minimum(tree->root)->data, "small");
+	rb_tree_destroy(tree, NULL, NULL);
+
+	options.key_type = RB_KEY_DOUBLE;
+	tree = rb_tree_alloc_with(&options);
+	for(int i = 0; i < 3; i++)
+		set(tree, (char*) &d[i], "d");
+	TEST_ASSERT_TRUE(*(double*) tree_minimum(tree->root)->key == -1.0);
+	TEST_ASSERT_TRUE(*(double*) tree_maximum(tree->root)->key == 2.5);
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* Byte keys may contain NULs and order lexicographically. */
+	options.key_type = RB_KEY_BYTES;
+	tree = rb_tree_alloc_with(&options);
+	rb_insert(tree, rb_tree_node_alloc(tree, "b\0a", 3, "b0a"));
+	rb_insert(tree, rb_tree_node_alloc(tree, "b", 1, "b"));
+	rb_insert(tree, rb_tree_node_alloc(tree, "ab", 2, "ab"));
+	TEST_ASSERT_EQUAL_STRING(rb_find(tree, "b\0a", 3)->data, "b0a");
+	TEST_ASSERT_EQUAL_STRING(tree_minimum(tree->root)->data, "ab");
+	TEST_ASSERT_EQUAL_STRING(tree_maximum(tree->root)->data, "b0a");
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+static int reverse_compare(const void *a, size_t a_len, const void *b, size_t b_len){
+	return -BYTES_COMPARE(a, a_len, b, b_len);
+}
+
+void test_custom_comparator(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+
+	options.key_type = RB_KEY_CUSTOM;
+	options.compare = reverse_compare;
+	tree = rb_tree_alloc_with(&options);
+	set(tree, "a", "a");
+	set(tree, "c", "c");
+	set(tree, "b", "b");
+	TEST_ASSERT_EQUAL_STRING(tree_minimum(tree->root)->key, "c");
+	TEST_ASSERT_EQUAL_STRING(tree_maximum(tree->root)->key, "a");
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* A custom tree needs a comparator, and unknown key types are refused. */
+	options.compare = NULL;
+	TEST_ASSERT_EQUAL(rb_tree_alloc_with(&options), NULL);
+	TEST_ASSERT_EQUAL(rb_td_alloc(&options), NULL);
+	TEST_ASSERT_EQUAL(rb_persist_alloc(&options), NULL);
+	options.key_type = (enum rb_key_type) 99;
+	options.compare = reverse_compare;
+	TEST_ASSERT_EQUAL(rb_tree_alloc_with(&options), NULL);
+	TEST_ASSERT_EQUAL(rb_td_alloc(&options), NULL);
+}
+
+void test_typed_tree(){
+	struct id_index index;
+	struct id_index_node *node;
+	bool inserted;
+	int64_t k, expected;
+
+	id_index_init(&index);
+	for(int64_t i = 0; i < 10000; i++){
+		k = scrambled(i, 10000);
+		node = id_index_insert(&index, k, (void*) (intptr_t) (k * 2), &inserted);
+		TEST_ASSERT_TRUE(inserted);
+	}
+	TEST_ASSERT_EQUAL(index.count, 10000);
+
+	node = id_index_insert(&index, 5, NULL, &inserted);
+	TEST_ASSERT_FALSE(inserted);
+	TEST_ASSERT_EQUAL(node->value, (void*) 10);
+
+	expected = 0;
+	for(node = id_index_first(&index); node != NULL; node = id_index_next(&index, node))
+		TEST_ASSERT_EQUAL_INT64(expected++, node->key);
+	TEST_ASSERT_EQUAL_INT64(10000, expected);
+
+	for(k = 0; k < 10000; k += 2)
+		TEST_ASSERT_TRUE(id_index_remove(&index, k));
+	TEST_ASSERT_FALSE(id_index_remove(&index, 0));
+	TEST_ASSERT_EQUAL(id_index_find(&index, 4), NULL);
+	TEST_ASSERT_EQUAL(id_index_find(&index, 5)->value, (void*) 10);
+	TEST_ASSERT_EQUAL_INT64(9999, id_index_last(&index)->key);
+	TEST_ASSERT_EQUAL_INT64(9997, id_index_prev(&index, id_index_last(&index))->key);
+
+	id_index_clear(&index);
+	TEST_ASSERT_EQUAL(index.count, 0);
+	TEST_ASSERT_EQUAL(id_index_first(&index), NULL);
+}
+
+static const void *arena_child(const void *tree, const void *node, int dir){
+	const struct rb_arena *arena = tree;
+	uint32_t child = dir ? ((const struct rb_arena_node*) node)->right : ((const struct rb_arena_node*) node)->left;
+
+	return child == RB_ARENA_NIL ? NULL : RB_ARENA_NODE(arena, child);
+}
+
+static bool arena_red(const void *tree, const void *node){
+	(void) tree;
+	return ((const struct rb_arena_node*) node)->color == 1;
+}
+
+static int arena_black_height(const struct rb_arena *arena){
+	const struct rb_shape shape = {arena_child, arena_red, false, arena};
+	uint32_t root = RB_ARENA_ROOT(arena);
+
+	return shape_black_height(&shape, root == RB_ARENA_NIL ? NULL : RB_ARENA_NODE(arena, root));
 }
 
+static bool td_check_order(struct rb_td_node *node, void *ctx){
+	int64_t *expected = ctx;
+
+	TEST_ASSERT_EQUAL_INT64(*expected, *(const int64_t*) rb_td_key(node));
+	*expected += 2;
+	return true;
+}
+
+void test_topdown_tree(){
+	struct rb_tree_options options = {0};
+	struct rb_td_tree *tree;
+	struct rb_td_tree *strings;
+	struct rb_td_node *node;
+	bool inserted;
+	int64_t k, expected;
+	char key[32];
+
+	options.key_type = RB_KEY_INT64;
+	tree = rb_td_alloc(&options);
+	for(int64_t i = 0; i < 10000; i++){
+		k = scrambled(i, 10000);
+		node = rb_td_insert(tree, &k, sizeof(k), (void*) (intptr_t) (k * 2), &inserted);
+		TEST_ASSERT_TRUE(inserted);
+	}
+	TEST_ASSERT_EQUAL(tree->count, 10000);
+	TEST_ASSERT_TRUE(shape_black_height(&td_shape, tree->root) > 0);
+	TEST_ASSERT_FALSE(rb_td_is_red(tree->root));
+
+	k = 5;
+	node = rb_td_insert(tree, &k, sizeof(k), NULL, &inserted);
+	TEST_ASSERT_FALSE(inserted);
+	TEST_ASSERT_EQUAL(node->data, (void*) 10);
+
+	for(k = 1; k < 10000; k += 2)
+		TEST_ASSERT_TRUE(rb_td_delete(tree, &k, sizeof(k)));
+	k = 1;
+	TEST_ASSERT_FALSE(rb_td_delete(tree, &k, sizeof(k)));
+	TEST_ASSERT_EQUAL(rb_td_find(tree, &k, sizeof(k)), NULL);
+	k = 4;
+	TEST_ASSERT_EQUAL(rb_td_find(tree, &k, sizeof(k))->data, (void*) 8);
+	TEST_ASSERT_EQUAL(tree->count, 5000);
+	TEST_ASSERT_TRUE(shape_black_height(&td_shape, tree->root) > 0);
+
+	expected = 0;
+	TEST_ASSERT_EQUAL(rb_td_walk(tree, td_check_order, &expected), 5000);
+	TEST_ASSERT_EQUAL_INT64(10000, expected);
+	rb_td_destroy(tree);
+
+	/* Short keys live in the node, long ones on the heap; deletes move both. */
+	strings = rb_td_alloc(NULL);
+	for(int i = 0; i < 500; i++){
+		sprintf(key, i % 2 ? "%d" : "a much longer key %d", i);
+		rb_td_insert(strings, key, strlen(key), NULL, NULL);
+	}
+	for(int i = 0; i < 500; i += 3){
+		sprintf(key, i % 2 ? "%d" : "a much longer key %d", i);
+		TEST_ASSERT_TRUE(rb_td_delete(strings, key, strlen(key)));
+	}
+	for(int i = 0; i < 500; i++){
+		sprintf(key, i % 2 ? "%d" : "a much longer key %d", i);
+		node = rb_td_find(strings, key, strlen(key));
+		if (i % 3 == 0){
+			TEST_ASSERT_EQUAL(node, NULL);
+		}else{
+			TEST_ASSERT_EQUAL_STRING(key, rb_td_key(node));
+		}
+	}
+	TEST_ASSERT_TRUE(shape_black_height(&td_shape, strings->root) > 0);
+	rb_td_destroy(strings);
+}
+
+void test_arena_tree(){
+	struct rb_arena arena, copy;
+	uint32_t i, slots;
+	bool inserted;
+	int64_t k, expected;
+
+	TEST_ASSERT_TRUE(rb_arena_init(&arena, 4));
+	TEST_ASSERT_EQUAL(rb_arena_first(&arena), RB_ARENA_NIL);
+	for(int64_t n = 0; n < 10000; n++){
+		k = scrambled(n, 10000);
+		i = rb_arena_insert(&arena, k, (uint64_t) k * 2, &inserted);
+		TEST_ASSERT_TRUE(inserted);
+		TEST_ASSERT_EQUAL_INT64(k, RB_ARENA_NODE(&arena, i)->key);
+	}
+	TEST_ASSERT_EQUAL(arena.count, 10000);
+	TEST_ASSERT_EQUAL(arena.used, 10001);
+	TEST_ASSERT_TRUE(arena_black_height(&arena) > 0);
+
+	i = rb_arena_insert(&arena, 5, 0, &inserted);
+	TEST_ASSERT_FALSE(inserted);
+	TEST_ASSERT_EQUAL(RB_ARENA_NODE(&arena, i)->value, 10);
+
+	for(k = 0; k < 10000; k += 2)
+		TEST_ASSERT_TRUE(rb_arena_delete(&arena, k));
+	TEST_ASSERT_FALSE(rb_arena_delete(&arena, 0));
+	TEST_ASSERT_EQUAL(rb_arena_find(&arena, 4), RB_ARENA_NIL);
+	TEST_ASSERT_EQUAL(arena.count, 5000);
+	TEST_ASSERT_TRUE(arena_black_height(&arena) > 0);
+
+	/* Freed slots are reused before the array grows. */
+	slots = arena.used;
+	for(k = 0; k < 10000; k += 4)
+		rb_arena_insert(&arena, k, (uint64_t) k * 2, NULL);
+	TEST_ASSERT_EQUAL(arena.used, slots);
+	TEST_ASSERT_TRUE(arena_black_height(&arena) > 0);
+
+	/* The array has no pointers in it, so a byte copy is a working tree. */
+	copy = arena;
+	copy.nodes = malloc(arena.used * sizeof(struct rb_arena_node));
+	memcpy(copy.nodes, arena.nodes, arena.used * sizeof(struct rb_arena_node));
+	rb_arena_destroy(&arena);
+
+	TEST_ASSERT_EQUAL(RB_ARENA_NODE(&copy, rb_arena_find(&copy, 9999))->value, 19998);
+	expected = 0;
+	for(i = rb_arena_first(&copy); i != RB_ARENA_NIL; i = rb_arena_next(&copy, i)){
+		TEST_ASSERT_EQUAL_INT64(expected, RB_ARENA_NODE(&copy, i)->key);
+		/* Odd keys and multiples of 4 are left. */
+		expected += (expected % 4 == 1) ? 2 : 1;
+	}
+	TEST_ASSERT_EQUAL_INT64(10000, expected);
+	rb_arena_destroy(&copy);
+}
+
+void test_insert_hint_and_finger_search(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_node *node, *last = NULL;
+	struct rb_stats stats;
+	int64_t k;
+
+	options.key_type = RB_KEY_INT64;
+	tree = rb_tree_alloc_with(&options);
+
+	/* Ascending appends, each hinted with the previous node. */
+	for(k = 0; k < 20000; k += 2){
+		node = rb_tree_node_alloc(tree, &k, sizeof(k), NULL);
+		rb_insert_hint(tree, last, node);
+		last = node;
+	}
+	TEST_ASSERT_EQUAL_PTR(last, tree->max);
+	TEST_ASSERT_TRUE(black_height(tree->root) > 0);
+
+	/* Odd keys hinted from a node far away, in both directions. */
+	for(k = 1; k < 20000; k += 2){
+		node = rb_tree_node_alloc(tree, &k, sizeof(k), NULL);
+		rb_insert_hint(tree, (k / 2) % 2 ? tree_minimum(tree->root) : tree->max, node);
+	}
+	TEST_ASSERT_TRUE(black_height(tree->root) > 0);
+	k = 0;
+	for(node = tree_minimum(tree->root); node != RB_NIL; node = tree_successor(node))
+		TEST_ASSERT_EQUAL_INT64(k++, *(int64_t*) node->key);
+	TEST_ASSERT_EQUAL_INT64(20000, k);
+
+	/* Finger searches from a node near and far from the key. */
+	k = 10000;
+	last = rb_find(tree, &k, sizeof(k));
+	for(k = 0; k < 20000; k += 7){
+		node = rb_finger_search(tree, last, &k, sizeof(k));
+		TEST_ASSERT_EQUAL_INT64(k, *(int64_t*) node->key);
+		last = node;
+	}
+	k = -1;
+	TEST_ASSERT_EQUAL(rb_finger_search(tree, last, &k, sizeof(k)), NULL);
+	k = 20000;
+	TEST_ASSERT_EQUAL(rb_finger_search(tree, tree->root, &k, sizeof(k)), NULL);
+	TEST_ASSERT_EQUAL(rb_finger_search(tree, NULL, &k, sizeof(k)), NULL);
+
+	/* The cached maximum follows deletes. */
+	k = 19999;
+	TEST_ASSERT_TRUE(rb_delete_key(tree, &k, sizeof(k)));
+	TEST_ASSERT_EQUAL_INT64(19998, *(int64_t*) tree->max->key);
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* Appends hinted with the first node go straight to the maximum:
+	   one comparison with the hint and one with the maximum. */
+	tree = rb_tree_alloc_with(&options);
+	k = 0;
+	last = rb_tree_node_alloc(tree, &k, sizeof(k), NULL);
+	rb_insert_hint(tree, NULL, last);
+	rb_tree_stats_reset(tree);
+	for(k = 1; k < 1000; k++)
+		rb_insert_hint(tree, last, rb_tree_node_alloc(tree, &k, sizeof(k), NULL));
+	if (rb_tree_stats(tree, &stats))
+		TEST_ASSERT_TRUE(stats.compares <= 2 * 999);
+	TEST_ASSERT_EQUAL(RB_VALID, rb_tree_validate(tree));
+	TEST_ASSERT_EQUAL_INT64(999, *(int64_t*) tree->max->key);
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_stats(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_stats stats;
+	int64_t k;
+
+	options.key_type = RB_KEY_INT64;
+	tree = rb_tree_alloc_with(&options);
+	for(k = 0; k < 1000; k++)
+		rb_insert(tree, rb_tree_node_alloc(tree, &k, sizeof(k), NULL));
+	for(k = 0; k < 1000; k += 2)
+		rb_delete_key(tree, &k, sizeof(k));
+
+#ifdef RB_STATS
+	TEST_ASSERT_TRUE(rb_tree_stats(tree, &stats));
+	TEST_ASSERT_EQUAL(stats.node_allocs, 1000);
+	TEST_ASSERT_EQUAL(stats.node_frees, 500);
+	/* Ascending inserts only ever take the outer rotation. */
+	TEST_ASSERT_TRUE(stats.insert_case1 > 0);
+	TEST_ASSERT_EQUAL(stats.insert_case2, 0);
+	TEST_ASSERT_TRUE(stats.insert_case3 > 0);
+	TEST_ASSERT_TRUE(stats.left_rotations >= stats.insert_case3);
+	TEST_ASSERT_TRUE(stats.delete_fixup_iterations > 0);
+	/* Each insert and delete descends at most 2 log2(n) levels. */
+	TEST_ASSERT_TRUE(stats.compares >= 1000);
+	TEST_ASSERT_TRUE(stats.compares <= 1500 * 2 * 10);
+
+	rb_tree_stats_reset(tree);
+	k = 1;
+	rb_find(tree, &k, sizeof(k));
+	rb_tree_stats(tree, &stats);
+	TEST_ASSERT_TRUE(stats.compares > 0 && stats.compares <= 2 * 9);
+	TEST_ASSERT_EQUAL(stats.node_allocs, 0);
+#else
+	TEST_ASSERT_FALSE(rb_tree_stats(tree, &stats));
+	TEST_ASSERT_EQUAL(stats.compares, 0);
+#endif
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_profile(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_profile profile;
+	size_t total = 0;
+	char key[40];
+	int64_t k;
+
+	options.key_type = RB_KEY_INT64;
+	tree = rb_tree_alloc_with(&options);
+	rb_tree_profile(tree, &profile);
+	TEST_ASSERT_EQUAL(profile.nodes, 0);
+	TEST_ASSERT_EQUAL(profile.height, 0);
+
+	for(k = 0; k < 1023; k++)
+		rb_insert(tree, rb_tree_node_alloc(tree, &k, sizeof(k), NULL));
+	rb_tree_profile(tree, &profile);
+	TEST_ASSERT_EQUAL(profile.nodes, 1023);
+	TEST_ASSERT_EQUAL(profile.black_height, black_height(tree->root) - 1);
+	TEST_ASSERT_TRUE(profile.height >= 10 && profile.height <= 20);
+	TEST_ASSERT_EQUAL(profile.depth_histogram[0], 1);
+	for(int d = 0; d < RB_PROFILE_MAX_DEPTH; d++)
+		total += profile.depth_histogram[d];
+	TEST_ASSERT_EQUAL(total, 1023);
+	TEST_ASSERT_TRUE(profile.average_depth >= 9 && profile.average_depth <= profile.height);
+	/* Every node on the path costs at least one line; inline keys add none. */
+	TEST_ASSERT_TRUE(profile.cache_lines_per_lookup >= profile.average_depth);
+	TEST_ASSERT_TRUE(profile.cache_lines_per_lookup <= 2 * profile.average_depth);
+	TEST_ASSERT_EQUAL(profile.key_bytes, 0);
+	TEST_ASSERT_EQUAL(profile.node_bytes, 1023 * tree->node_size);
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* Long keys live outside the node and cost extra lines. */
+	tree = rb_tree_alloc();
+	for(int i = 0; i < 100; i++){
+		sprintf(key, "a key too long to fit inline %03d", i);
+		set(tree, key, NULL);
+	}
+	rb_tree_profile(tree, &profile);
+	TEST_ASSERT_EQUAL(profile.key_bytes, 100 * strlen(key));
+	TEST_ASSERT_TRUE(profile.cache_lines_per_lookup > profile.average_depth + 1);
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_sentinel_is_never_written(){
+	struct rb_tree *tree = rb_tree_alloc();
+	char key[10];
+
+	TEST_ASSERT_EQUAL_PTR(SENTINEL(), RB_NIL);
+	for(int i = 0; i < 2000; i++){
+		sprintf(key, "%d", i);
+		set(tree, key, key);
+	}
+	for(int i = 0; i < 2000; i += 3){
+		sprintf(key, "%d", i);
+		TEST_ASSERT_EQUAL(delete(tree, key), true);
+	}
+	TEST_ASSERT_EQUAL(rb_parent(RB_NIL), NULL);
+	TEST_ASSERT_EQUAL(RB_NIL->left, NULL);
+	TEST_ASSERT_EQUAL(RB_NIL->right, NULL);
+	TEST_ASSERT_EQUAL(rb_color(RB_NIL), 0);
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+/* struct rb_node as laid out without RB_COMPACT_COLOR, to compare sizes. */
+struct wide_node{
+	struct rb_node *parent, *left, *right;
+	void *key, *data;
+	char key_buf[RB_INLINE_KEY_SIZE];
+	uint32_t key_len;
+	unsigned int color:1;
+	unsigned int bare:1;
+	uint64_t aux[];
+};
+
+void test_compact_color(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_node node, *recycled;
+
+#ifdef RB_COMPACT_COLOR
+	TEST_ASSERT_TRUE(sizeof(struct rb_node) < sizeof(struct wide_node));
+	TEST_ASSERT_TRUE(sizeof(struct rb_node) <= 56);
+	options.order_stats = true;
+	tree = rb_tree_alloc_with(&options);
+	TEST_ASSERT_TRUE(tree->node_size <= 64);
+	rb_tree_destroy(tree, NULL, NULL);
+#else
+	TEST_ASSERT_EQUAL(sizeof(struct wide_node), sizeof(struct rb_node));
+#endif
+
+	/* Parent and colour (1 red, 0 black) never disturb each other. */
+	rb_set_parent(&node, RB_NIL);
+	rb_set_color(&node, 1);
+	rb_set_parent(&node, &node);
+	TEST_ASSERT_EQUAL_PTR(&node, rb_parent(&node));
+	TEST_ASSERT_EQUAL(1, rb_color(&node));
+	rb_set_color(&node, 0);
+	TEST_ASSERT_EQUAL_PTR(&node, rb_parent(&node));
+	TEST_ASSERT_EQUAL(0, rb_color(&node));
+
+	/* A node recycled by the pool starts red and unlinked, whatever it was. */
+	options.order_stats = false;
+	options.pool_chunk_nodes = 8;
+	tree = rb_tree_alloc_with(&options);
+	recycled = rb_tree_node_alloc(tree, "k", 1, NULL);
+	rb_set_parent(recycled, &node);
+	rb_set_color(recycled, 0);
+	rb_tree_free_node(tree, recycled);
+	TEST_ASSERT_EQUAL_PTR(recycled, rb_tree_node_alloc(tree, "k", 1, NULL));
+	TEST_ASSERT_EQUAL_PTR(RB_NIL, rb_parent(recycled));
+	TEST_ASSERT_EQUAL(1, rb_color(recycled));
+	rb_tree_free_node(tree, recycled);
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_delete_black_leaf(){
+	struct rb_tree *tree = rb_tree_alloc();
+	char key[10];
+
+	/* Deleting a black leaf leaves x as the sentinel, which must still be
+	   rebalanced through its parent. */
+	for(int i = 0; i < 256; i++){
+		sprintf(key, "%03d", i);
+		set(tree, key, key);
+	}
+	for(int i = 0; i < 256; i += 2){
+		sprintf(key, "%03d", i);
+		TEST_ASSERT_TRUE(delete(tree, key));
+		TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_VALID);
+	}
+	for(int i = 255; i > 0; i -= 2){
+		sprintf(key, "%03d", i);
+		TEST_ASSERT_TRUE(delete(tree, key));
+		TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_VALID);
+	}
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_upsert_and_delete_key(){
+	struct rb_tree *tree = rb_tree_alloc();
+	struct rb_node *node, *again;
+	bool inserted;
+
+	node = rb_upsert(tree, "key", 3, &inserted);
+	TEST_ASSERT_TRUE(inserted);
+	TEST_ASSERT_EQUAL(node->data, NULL);
+	TEST_ASSERT_EQUAL_STRING(node->key, "key");
+
+	again = rb_upsert(tree, "key", 3, &inserted);
+	TEST_ASSERT_FALSE(inserted);
+	TEST_ASSERT_EQUAL_PTR(node, again);
+
+	for(char c = 'a'; c <= 'z'; c++)
+		rb_upsert(tree, &c, 1, NULL);
+	TEST_ASSERT_TRUE(rb_delete_key(tree, "key", 3));
+	TEST_ASSERT_FALSE(rb_delete_key(tree, "key", 3));
+	TEST_ASSERT_TRUE(rb_delete_key(tree, "q", 1));
+	TEST_ASSERT_EQUAL(rb_find(tree, "q", 1), NULL);
+	TEST_ASSERT_EQUAL_STRING(rb_find(tree, "r", 1)->key, "r");
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_build_sorted(){
+	char *keys[1000], *values[1000];
+	char buffer[1000][8];
+	struct rb_tree *tree;
+	struct rb_node *node;
+
+	for(int i = 0; i < 1000; i++){
+		sprintf(buffer[i], "%d", i);
+		keys[i] = values[i] = buffer[i];
+	}
+
+	for(size_t n = 0; n <= 1000; n += (n < 20) ? 1 : 97){
+		tree = rb_tree_alloc();
+		TEST_ASSERT_TRUE(rb_tree_build_sorted(tree, keys, values, n));
+		TEST_ASSERT_TRUE(black_height(tree->root) > 0);
+		TEST_ASSERT_EQUAL(rb_color(tree->root), 0);
+		for(size_t i = 0; i < n; i++){
+			node = rb_search(tree, keys[i]);
+			TEST_ASSERT_EQUAL_STRING(keys[i], node->data);
+			if (i > 0)
+				TEST_ASSERT_EQUAL_STRING(keys[i], tree_successor(rb_search(tree, keys[i - 1]))->key);
+		}
+		TEST_ASSERT_FALSE(rb_tree_build_sorted(tree, keys, values, n) && n > 0);
+		rb_tree_destroy(tree, NULL, NULL);
+	}
+
+	/* The result is an ordinary tree that accepts further updates. */
+	tree = rb_tree_alloc();
+	rb_tree_build_sorted(tree, keys, NULL, 500);
+	TEST_ASSERT_EQUAL(rb_search(tree, "7")->data, NULL);
+	for(int i = 0; i < 500; i += 2)
+		TEST_ASSERT_TRUE(delete(tree, keys[i]));
+	for(int i = 500; i < 1000; i++)
+		set(tree, keys[i], values[i]);
+	for(int i = 1; i < 1000; i += (i < 500) ? 2 : 1)
+		TEST_ASSERT_EQUAL_STRING(keys[i], rb_search(tree, keys[i])->key);
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_search_batch(){
+	struct rb_tree *tree = rb_tree_alloc();
+	char buffer[2000][24];
+	const void *keys[2000];
+	size_t lens[2000];
+	struct rb_node *out[2000];
+
+	/* Every other key is present; some keys are too long to be inline. */
+	for(int i = 0; i < 2000; i++){
+		sprintf(buffer[i], (i % 3) ? "%d" : "a long key number %d", i);
+		keys[i] = buffer[i];
+		lens[i] = strlen(buffer[i]);
+		if (i % 2 == 0)
+			set(tree, buffer[i], buffer[i]);
+	}
+
+	rb_search_batch(tree, keys, NULL, 2000, out);
+	for(int i = 0; i < 2000; i++)
+		TEST_ASSERT_EQUAL_PTR(rb_find(tree, keys[i], lens[i]), out[i]);
+
+	rb_search_batch(tree, keys + 10, lens + 10, 3, out);
+	TEST_ASSERT_EQUAL_STRING(buffer[10], out[0]->key);
+	TEST_ASSERT_EQUAL(out[1], NULL);
+	TEST_ASSERT_EQUAL_STRING(buffer[12], out[2]->key);
+
+	rb_search_batch(tree, keys, lens, 0, out);
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+struct int64_collector{
+	int64_t keys[16];
+	size_t count;
+	size_t limit;
+};
+
+static bool collect_int64(struct rb_node *node, void *ctx){
+	struct int64_collector *collector = ctx;
+	collector->keys[collector->count++] = *(int64_t*) node->key;
+	return collector->count < collector->limit;
+}
+
+void test_bounds_and_range(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct int64_collector seen = {{0}, 0, 16};
+	int64_t k, lo, hi;
+
+	options.key_type = RB_KEY_INT64;
+	tree = rb_tree_alloc_with(&options);
+	for(k = 10; k <= 100; k += 10)
+		rb_upsert(tree, &k, sizeof(k), NULL);
+
+	k = 35;
+	TEST_ASSERT_EQUAL_INT64(40, *(int64_t*) rb_lower_bound(tree, &k, sizeof(k))->key);
+	TEST_ASSERT_EQUAL_INT64(40, *(int64_t*) rb_ceiling(tree, &k, sizeof(k))->key);
+	TEST_ASSERT_EQUAL_INT64(40, *(int64_t*) rb_upper_bound(tree, &k, sizeof(k))->key);
+	TEST_ASSERT_EQUAL_INT64(30, *(int64_t*) rb_floor(tree, &k, sizeof(k))->key);
+	k = 40;
+	TEST_ASSERT_EQUAL_INT64(40, *(int64_t*) rb_lower_bound(tree, &k, sizeof(k))->key);
+	TEST_ASSERT_EQUAL_INT64(50, *(int64_t*) rb_upper_bound(tree, &k, sizeof(k))->key);
+	TEST_ASSERT_EQUAL_INT64(40, *(int64_t*) rb_floor(tree, &k, sizeof(k))->key);
+	k = 5;
+	TEST_ASSERT_EQUAL(rb_floor(tree, &k, sizeof(k)), NULL);
+	k = 100;
+	TEST_ASSERT_EQUAL(rb_upper_bound(tree, &k, sizeof(k)), NULL);
+
+	lo = 25; hi = 60;
+	TEST_ASSERT_EQUAL(4, rb_range(tree, &lo, sizeof(lo), &hi, sizeof(hi), collect_int64, &seen));
+	TEST_ASSERT_EQUAL(4, seen.count);
+	TEST_ASSERT_EQUAL_INT64(30, seen.keys[0]);
+	TEST_ASSERT_EQUAL_INT64(60, seen.keys[3]);
+
+	/* The callback stops the scan when it returns false. */
+	seen.count = 0;
+	seen.limit = 2;
+	lo = 0; hi = 1000;
+	TEST_ASSERT_EQUAL(2, rb_range(tree, &lo, sizeof(lo), &hi, sizeof(hi), collect_int64, &seen));
+	TEST_ASSERT_EQUAL_INT64(20, seen.keys[1]);
+
+	lo = 61; hi = 69;
+	TEST_ASSERT_EQUAL(0, rb_range(tree, &lo, sizeof(lo), &hi, sizeof(hi), collect_int64, &seen));
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_iterator(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_iter iter;
+	struct rb_node *node;
+	int64_t k, expected;
+
+	options.key_type = RB_KEY_INT64;
+	tree = rb_tree_alloc_with(&options);
+	TEST_ASSERT_EQUAL(rb_iter_first(&iter, tree), NULL);
+	TEST_ASSERT_EQUAL(rb_iter_last(&iter, tree), NULL);
+
+	for(int64_t i = 0; i < 5000; i++){
+		k = scrambled(i, 5000) * 2;
+		rb_upsert(tree, &k, sizeof(k), NULL);
+	}
+
+	expected = 0;
+	for(node = rb_iter_first(&iter, tree); node != NULL; node = rb_iter_next(&iter)){
+		TEST_ASSERT_EQUAL_INT64(expected, *(int64_t*) node->key);
+		expected += 2;
+	}
+	TEST_ASSERT_EQUAL_INT64(10000, expected);
+	TEST_ASSERT_EQUAL(rb_iter_next(&iter), NULL);
+
+	for(node = rb_iter_last(&iter, tree); node != NULL; node = rb_iter_prev(&iter)){
+		expected -= 2;
+		TEST_ASSERT_EQUAL_INT64(expected, *(int64_t*) node->key);
+	}
+	TEST_ASSERT_EQUAL_INT64(0, expected);
+
+	/* Seek lands on the lower bound and can move either way from there. */
+	k = 4321;
+	TEST_ASSERT_EQUAL_INT64(4322, *(int64_t*) rb_iter_seek(&iter, tree, &k, sizeof(k))->key);
+	TEST_ASSERT_EQUAL_INT64(4324, *(int64_t*) rb_iter_next(&iter)->key);
+	TEST_ASSERT_EQUAL_INT64(4322, *(int64_t*) rb_iter_prev(&iter)->key);
+	TEST_ASSERT_EQUAL_INT64(4320, *(int64_t*) rb_iter_prev(&iter)->key);
+	k = 0;
+	TEST_ASSERT_EQUAL_INT64(0, *(int64_t*) rb_iter_seek(&iter, tree, &k, sizeof(k))->key);
+	TEST_ASSERT_EQUAL(rb_iter_prev(&iter), NULL);
+	k = 9999;
+	TEST_ASSERT_EQUAL(rb_iter_seek(&iter, tree, &k, sizeof(k)), NULL);
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_order_statistics(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_node *node;
+	int64_t k, lo, hi;
+	char *keys[100], buffer[100][4];
+
+	options.key_type = RB_KEY_INT64;
+	options.order_stats = true;
+	tree = rb_tree_alloc_with(&options);
+	/* Keys 0, 3, 6, ..., 2997 in scrambled order. */
+	for(int64_t i = 0; i < 1000; i++){
+		k = scrambled(i, 1000) * 3;
+		rb_upsert(tree, &k, sizeof(k), NULL);
+	}
+	TEST_ASSERT_EQUAL(1000, rb_tree_size(tree));
+	for(size_t i = 0; i < 1000; i++)
+		TEST_ASSERT_EQUAL_INT64(i * 3, *(int64_t*) rb_select(tree, i)->key);
+	TEST_ASSERT_EQUAL(rb_select(tree, 1000), NULL);
+
+	k = 300;
+	TEST_ASSERT_EQUAL(100, rb_rank(tree, &k, sizeof(k)));
+	k = 301;
+	TEST_ASSERT_EQUAL(101, rb_rank(tree, &k, sizeof(k)));
+	lo = 300; hi = 600;
+	TEST_ASSERT_EQUAL(101, rb_count_range(tree, &lo, sizeof(lo), &hi, sizeof(hi)));
+	lo = 301; hi = 302;
+	TEST_ASSERT_EQUAL(0, rb_count_range(tree, &lo, sizeof(lo), &hi, sizeof(hi)));
+
+	/* Sizes survive deletes of leaves, inner nodes and the root. */
+	for(k = 0; k < 3000; k += 6){
+		rb_delete_key(tree, &k, sizeof(k));
+		if (k % 600 == 0){
+			int64_t root_key = *(int64_t*) tree->root->key;
+			rb_delete_key(tree, &root_key, sizeof(root_key));
+			rb_upsert(tree, &root_key, sizeof(root_key), NULL);
+		}
+	}
+	TEST_ASSERT_EQUAL(500, rb_tree_size(tree));
+	for(size_t i = 0; i < 500; i++)
+		TEST_ASSERT_EQUAL_INT64(i * 6 + 3, *(int64_t*) rb_select(tree, i)->key);
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* Bulk-built trees get their sizes too. */
+	options.key_type = RB_KEY_STRING;
+	tree = rb_tree_alloc_with(&options);
+	for(int i = 0; i < 100; i++){
+		sprintf(buffer[i], "%d", i);
+		keys[i] = buffer[i];
+	}
+	rb_tree_build_sorted(tree, keys, NULL, 100);
+	TEST_ASSERT_EQUAL(100, rb_tree_size(tree));
+	TEST_ASSERT_EQUAL_STRING("42", rb_select(tree, 42)->key);
+	TEST_ASSERT_EQUAL(42, rb_rank(tree, "42", 2));
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* Nodes from rb_node_alloc_kv have no room for a size, so the tree
+	   leaves them out rather than writing past them. */
+	tree = rb_tree_alloc_with(&options);
+	set(tree, "a", NULL);
+	node = rb_node_alloc_kv("b", "b");
+	rb_insert(tree, node);
+	rb_insert_hint(tree, NULL, node);
+	TEST_ASSERT_EQUAL(1, rb_tree_size(tree));
+	TEST_ASSERT_EQUAL(NULL, rb_search(tree, "b"));
+	TEST_ASSERT_EQUAL(RB_VALID, rb_tree_validate(tree));
+	free(node->data);
+	free(node);
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* Sizes live in the aux fields, so other trees keep the smaller node
+	   and still count their nodes. */
+	TEST_ASSERT_TRUE(sizeof(struct rb_node) <= 64);
+	tree = rb_tree_alloc();
+	TEST_ASSERT_EQUAL(0, rb_tree_size(tree));
+	rb_tree_build_sorted(tree, keys, NULL, 100);
+	set(tree, "x", NULL);
+	TEST_ASSERT_TRUE(delete(tree, "42"));
+	TEST_ASSERT_EQUAL(100, rb_tree_size(tree));
+	rb_tree_clear(tree, NULL, NULL);
+	TEST_ASSERT_EQUAL(0, rb_tree_size(tree));
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+void test_interval_tree(){
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct int64_collector seen = {{0}, 0, 16};
+	struct rb_node *node, *next;
+	int64_t lo, expected;
+
+	options.interval = true;
+	tree = rb_tree_alloc_with(&options);
+	/* [i*10, i*10 + 5] for i in 0..99, plus one long interval and a duplicate low end. */
+	for(int64_t i = 0; i < 100; i++){
+		lo = (i * 37) % 100 * 10;
+		rb_interval_insert(tree, lo, lo + 5, NULL);
+	}
+	rb_interval_insert(tree, 200, 900, "long");
+	rb_interval_insert(tree, 500, 501, "dup");
+	TEST_ASSERT_EQUAL_INT64(995, rb_node_interval(tree->root)->max_hi);
+
+	TEST_ASSERT_EQUAL(3, rb_interval_overlaps(tree, 503, 510, collect_int64, &seen));
+	TEST_ASSERT_EQUAL_INT64(200, seen.keys[0]);
+	TEST_ASSERT_EQUAL_INT64(500, seen.keys[1]);
+	TEST_ASSERT_EQUAL_INT64(510, seen.keys[2]);
+
+	seen.count = 0;
+	TEST_ASSERT_EQUAL(0, rb_interval_overlaps(tree, 906, 909, collect_int64, &seen));
+	TEST_ASSERT_EQUAL(2, rb_interval_overlaps(tree, 196, 200, collect_int64, &seen));
+
+	/* Delete every interval that ends before 900 except the long one; max_hi
+	   must follow the deletions through rotations and transplants. */
+	for(node = tree_minimum(tree->root); node != RB_NIL; node = next){
+		next = tree_successor(node);
+		if (rb_node_interval(node)->hi < 900){
+			rb_delete(tree, node);
+			rb_tree_free_node(tree, node);
+		}
+	}
+	seen.count = 0;
+	TEST_ASSERT_EQUAL(11, rb_interval_overlaps(tree, 0, 2000, collect_int64, &seen));
+	TEST_ASSERT_EQUAL_INT64(200, seen.keys[0]);
+	expected = 900;
+	for(size_t i = 1; i < 11; i++, expected += 10)
+		TEST_ASSERT_EQUAL_INT64(expected, seen.keys[i]);
+	seen.count = 0;
+	TEST_ASSERT_EQUAL(1, rb_interval_overlaps(tree, 300, 300, collect_int64, &seen));
+	TEST_ASSERT_EQUAL_INT64(200, seen.keys[0]);
+
+	/* Keys added without an interval hold the point [lo, lo]. */
+	lo = 2000;
+	rb_upsert(tree, &lo, sizeof(lo), NULL);
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_VALID);
+	TEST_ASSERT_EQUAL_INT64(2000, rb_node_interval(tree->max)->hi);
+	seen.count = 0;
+	TEST_ASSERT_EQUAL(1, rb_interval_overlaps(tree, 1990, 2000, collect_int64, &seen));
+	TEST_ASSERT_EQUAL(0, rb_interval_overlaps(tree, 2001, 3000, collect_int64, &seen));
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+static void sum_identity(void *out){
+	*(int64_t*) out = 0;
+}
+
+static void sum_value(void *out, const struct rb_node *node){
+	*(int64_t*) out = node->data ? atol(node->data) : 0;
+}
+
+static void sum_combine(void *out, const void *left, const void *right){
+	*(int64_t*) out = *(const int64_t*) left + *(const int64_t*) right;
+}
+
+/* Not commutative: remembers the first and last key of the range and its length. */
+struct span{
+	int64_t first, last, count;
+};
+
+static void span_identity(void *out){
+	struct span empty = {0, 0, 0};
+	*(struct span*) out = empty;
+}
+
+static void span_value(void *out, const struct rb_node *node){
+	struct span one;
+	memcpy(&one.first, node->key, sizeof(int64_t));
+	one.last = one.first;
+	one.count = 1;
+	*(struct span*) out = one;
+}
+
+static void span_combine(void *out, const void *left, const void *right){
+	const struct span *a = left, *b = right;
+	struct span joined;
+	joined.first = a->count ? a->first : b->first;
+	joined.last = b->count ? b->last : a->last;
+	joined.count = a->count + b->count;
+	*(struct span*) out = joined;
+}
+
+void test_aggregate_range(){
+	struct rb_aggregate sum = {sizeof(int64_t), sum_identity, sum_value, sum_combine};
+	struct rb_aggregate spans = {sizeof(struct span), span_identity, span_value, span_combine};
+	struct rb_tree_options options = {0};
+	struct rb_tree *tree;
+	struct rb_node *node;
+	struct span result;
+	int64_t k, lo, hi, total, expected;
+	char value[16];
+
+	options.key_type = RB_KEY_INT64;
+	options.aggregate = &sum;
+	tree = rb_tree_alloc_with(&options);
+	/* Key k holds the value k * 2 for k in 0..999, inserted in scrambled order. */
+	for(int64_t i = 0; i < 1000; i++){
+		k = scrambled(i, 1000);
+		sprintf(value, "%d", (int) (k * 2));
+		set(tree, (char*) &k, value);
+	}
+	for(k = 0; k < 1000; k += 3)
+		delete(tree, (char*) &k);
+
+	for(lo = -5; lo < 1010; lo += 37){
+		for(hi = lo; hi < 1010; hi += 53){
+			expected = 0;
+			for(k = lo < 0 ? 0 : lo; k <= hi && k < 1000; k++)
+				if (k % 3)
+					expected += k * 2;
+			rb_aggregate_range(tree, &lo, sizeof(lo), &hi, sizeof(hi), &total);
+			TEST_ASSERT_EQUAL_INT64(expected, total);
+		}
+	}
+
+	/* Changing a value through set() updates the sums above it. */
+	k = 500;
+	set(tree, (char*) &k, "1000000");
+	lo = 499; hi = 501;
+	rb_aggregate_range(tree, &lo, sizeof(lo), &hi, sizeof(hi), &total);
+	TEST_ASSERT_EQUAL_INT64(1000000 + 998, total);
+	TEST_ASSERT_EQUAL_INT64(2 * (999 * 1000 / 2) - 2 * (999 * 334 / 2) - 1000 + 1000000,
+				*(int64_t*) rb_node_aggregate(tree, tree->root));
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* A node from rb_node_alloc_kv has no room for a sum, so the tree leaves
+	   it out rather than summing past its end. */
+	options.key_type = RB_KEY_STRING;
+	tree = rb_tree_alloc_with(&options);
+	set(tree, "a", "1");
+	node = rb_node_alloc_kv("b", "2");
+	rb_insert(tree, node);
+	TEST_ASSERT_EQUAL(NULL, rb_search(tree, "b"));
+	TEST_ASSERT_EQUAL_INT64(1, *(int64_t*) rb_node_aggregate(tree, tree->root));
+	TEST_ASSERT_EQUAL(RB_VALID, rb_tree_validate(tree));
+	free(node->data);
+	free(node);
+	rb_tree_destroy(tree, NULL, NULL);
+	options.key_type = RB_KEY_INT64;
+
+	options.aggregate = &spans;
+	tree = rb_tree_alloc_with(&options);
+	for(int64_t i = 0; i < 200; i++){
+		k = scrambled(i, 200);
+		rb_upsert(tree, &k, sizeof(k), NULL);
+	}
+	lo = 17; hi = 150;
+	rb_aggregate_range(tree, &lo, sizeof(lo), &hi, sizeof(hi), &result);
+	TEST_ASSERT_EQUAL_INT64(17, result.first);
+	TEST_ASSERT_EQUAL_INT64(150, result.last);
+	TEST_ASSERT_EQUAL_INT64(134, result.count);
+	lo = 300; hi = 400;
+	rb_aggregate_range(tree, &lo, sizeof(lo), &hi, sizeof(hi), &result);
+	TEST_ASSERT_EQUAL_INT64(0, result.count);
+	rb_tree_destroy(tree, NULL, NULL);
+
+	spans.size = RB_AGGREGATE_MAX + 1;
+	TEST_ASSERT_EQUAL(rb_tree_alloc_with(&options), NULL);
+}
+
+
+void test_validate(){
+	struct rb_tree_options options = {0};
+	struct rb_aggregate sums = {sizeof(int64_t), sum_identity, sum_value, sum_combine};
+	struct rb_tree *tree;
+	struct rb_node *node, *parent;
+	void *key;
+	char value[8];
+	int64_t k;
+
+	tree = rb_tree_alloc();
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_VALID);
+	rb_tree_destroy(tree, NULL, NULL);
+
+	/* Every kind of augmented tree, through inserts and deletes. */
+	options.key_type = RB_KEY_INT64;
+	options.order_stats = true;
+	options.aggregate = &sums;
+	tree = rb_tree_alloc_with(&options);
+	for(int64_t i = 0; i < 2000; i++){
+		k = scrambled(i, 2000);
+		sprintf(value, "%d", (int) k);
+		set(tree, (char*) &k, value);
+	}
+	for(k = 0; k < 2000; k += 3)
+		rb_delete_key(tree, &k, sizeof(k));
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_VALID);
+
+	/* Each kind of damage is reported, and undoing it makes the tree valid again. */
+	rb_set_color(tree->root, 1);
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_RED_ROOT);
+	rb_set_color(tree->root, 0);
+
+	node = tree_minimum(tree->root);
+	key = node->key;
+	node->key = tree->max->key;
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_BAD_ORDER);
+	node->key = key;
+
+	(*(int64_t*) rb_node_aggregate(tree, node))++;
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_BAD_AUGMENT);
+	(*(int64_t*) rb_node_aggregate(tree, node))--;
+
+	parent = rb_parent(node);
+	rb_set_parent(node, tree->root);
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_BAD_PARENT);
+	rb_set_parent(node, parent);
+
+	node = tree->max;
+	rb_set_color(node, !rb_color(node));
+	TEST_ASSERT_TRUE(rb_tree_validate(tree) == RB_RED_RED || rb_tree_validate(tree) == RB_BLACK_HEIGHT);
+	rb_set_color(node, !rb_color(node));
+
+	tree->max = tree_predecessor(node);
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_BAD_MAX);
+	tree->max = node;
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_VALID);
+	rb_tree_destroy(tree, NULL, NULL);
+
+	options = (struct rb_tree_options) {0};
+	options.interval = true;
+	tree = rb_tree_alloc_with(&options);
+	for(int64_t i = 0; i < 500; i++)
+		rb_interval_insert(tree, (i * 37) % 500, (i * 37) % 500 + i, NULL);
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_VALID);
+	rb_node_interval(tree->root)->max_hi++;
+	TEST_ASSERT_EQUAL(rb_tree_validate(tree), RB_BAD_AUGMENT);
+	rb_node_interval(tree->root)->max_hi--;
+	rb_tree_destroy(tree, NULL, NULL);
+}
+
+static const void *persist_child(const void *tree, const void *node, int dir){
+	(void) tree;
+	return ((const struct rb_persist_node*) node)->link[dir];
+}
+
+static bool persist_red(const void *tree, const void *node){
+	(void) tree;
+	return ((const struct rb_persist_node*) node)->red;
+}
+
+static const struct rb_shape persist_shape = {persist_child, persist_red, true, NULL};
+
+static bool persist_check_order(const struct rb_persist_node *node, void *ctx){
+	int64_t *expected = ctx;
+
+	TEST_ASSERT_EQUAL_INT64(*expected, *(const int64_t*) rb_persist_key(node));
+	*expected += 2;
+	return true;
+}
+
+static size_t persist_copied(struct rb_persist_tree *a, struct rb_persist_tree *b, int64_t n){
+	size_t copied = 0;
+
+	for(int64_t k = 0; k < n; k++)
+		copied += rb_persist_find(a, &k, sizeof(k)) != rb_persist_find(b, &k, sizeof(k));
+	return copied;
+}
+
+void test_persistent_tree(){
+	struct rb_tree_options options = {0};
+	struct rb_persist_tree *tree, *snapshot, *later, *strings;
+	const struct rb_persist_node *node;
+	int64_t k, expected;
+	char key[32];
+
+	options.key_type = RB_KEY_INT64;
+	tree = rb_persist_alloc(&options);
+	for(int64_t i = 0; i < 10000; i++){
+		k = scrambled(i, 10000);
+		TEST_ASSERT_TRUE(rb_persist_insert(tree, &k, sizeof(k), (void*) (intptr_t) (k * 2)));
+	}
+	TEST_ASSERT_EQUAL(tree->count, 10000);
+	TEST_ASSERT_TRUE(shape_black_height(&persist_shape, tree->root) > 0);
+
+	/* With no other version around, updates change nodes in place. */
+	k = 5000;
+	node = rb_persist_find(tree, &k, sizeof(k));
+	k = 20000;
+	rb_persist_insert(tree, &k, sizeof(k), NULL);
+	rb_persist_delete(tree, &k, sizeof(k));
+	k = 5000;
+	TEST_ASSERT_EQUAL(node, rb_persist_find(tree, &k, sizeof(k)));
+
+	/* A snapshot shares every node; one update copies only a few of them. */
+	snapshot = rb_snapshot(tree);
+	TEST_ASSERT_EQUAL(persist_copied(tree, snapshot, 10000), 0);
+	k = 5;
+	TEST_ASSERT_FALSE(rb_persist_insert(tree, &k, sizeof(k), (void*) 1));
+	TEST_ASSERT_TRUE(persist_copied(tree, snapshot, 10000) <= 3 * 28);
+	TEST_ASSERT_EQUAL(rb_persist_find(tree, &k, sizeof(k))->data, (void*) 1);
+	TEST_ASSERT_EQUAL(rb_persist_find(snapshot, &k, sizeof(k))->data, (void*) 10);
+	k = 3;
+	TEST_ASSERT_TRUE(rb_persist_delete(tree, &k, sizeof(k)));
+	TEST_ASSERT_TRUE(persist_copied(tree, snapshot, 10000) <= 6 * 28);
+
+	for(k = 1; k < 10000; k += 2)
+		rb_persist_delete(tree, &k, sizeof(k));
+	k = 1;
+	TEST_ASSERT_FALSE(rb_persist_delete(tree, &k, sizeof(k)));
+	TEST_ASSERT_EQUAL(rb_persist_find(tree, &k, sizeof(k)), NULL);
+	TEST_ASSERT_EQUAL(tree->count, 5000);
+	TEST_ASSERT_TRUE(shape_black_height(&persist_shape, tree->root) > 0);
+	expected = 0;
+	TEST_ASSERT_EQUAL(rb_persist_walk(tree, persist_check_order, &expected), 5000);
+	TEST_ASSERT_EQUAL_INT64(10000, expected);
+
+	/* The snapshot still holds every key, and outlives the tree it came from. */
+	later = rb_snapshot(tree);
+	rb_persist_destroy(tree);
+	TEST_ASSERT_EQUAL(snapshot->count, 10000);
+	TEST_ASSERT_TRUE(shape_black_height(&persist_shape, snapshot->root) > 0);
+	for(k = 0; k < 10000; k++)
+		TEST_ASSERT_EQUAL(rb_persist_find(snapshot, &k, sizeof(k))->data, (void*) (intptr_t) (k * 2));
+	expected = 1;
+	for(k = 0; k < 10000; k += 2)
+		TEST_ASSERT_TRUE(rb_persist_delete(snapshot, &k, sizeof(k)));
+	TEST_ASSERT_EQUAL(rb_persist_walk(snapshot, persist_check_order, &expected), 5000);
+	TEST_ASSERT_EQUAL(later->count, 5000);
+	k = 4;
+	TEST_ASSERT_EQUAL(rb_persist_find(later, &k, sizeof(k))->data, (void*) 8);
+	rb_persist_destroy(snapshot);
+	rb_persist_destroy(later);
+
+	strings = rb_persist_alloc(NULL);
+	for(int i = 0; i < 500; i++){
+		sprintf(key, i % 2 ? "%d" : "a much longer key %d", i);
+		rb_persist_insert(strings, key, strlen(key), NULL);
+	}
+	snapshot = rb_snapshot(strings);
+	for(int i = 0; i < 500; i += 3){
+		sprintf(key, i % 2 ? "%d" : "a much longer key %d", i);
+		TEST_ASSERT_TRUE(rb_persist_delete(strings, key, strlen(key)));
+	}
+	for(int i = 0; i < 500; i++){
+		sprintf(key, i % 2 ? "%d" : "a much longer key %d", i);
+		TEST_ASSERT_EQUAL_STRING(key, rb_persist_key(rb_persist_find(snapshot, key, strlen(key))));
+		node = rb_persist_find(strings, key, strlen(key));
+		if (i % 3 == 0){
+			TEST_ASSERT_EQUAL(node, NULL);
+		}else{
+			TEST_ASSERT_EQUAL_STRING(key, rb_persist_key(node));
+		}
+	}
+	TEST_ASSERT_TRUE(shape_black_height(&persist_shape, strings->root) > 0);
+	rb_persist_destroy(strings);
+	rb_persist_destroy(snapshot);
+}
 
 int main(int argc, char const *argv[])
 {
@@ -108,6 +1550,35 @@ int main(int argc, char const *argv[])
 	RUN_TEST(test_check_ordering);
 	RUN_TEST(test_insert_and_delete);
 	RUN_TEST(test_a_million_items);
+	RUN_TEST(test_destroy_and_clear);
+	RUN_TEST(test_pooled_tree);
+	RUN_TEST(test_destroy_unpooled_tree);
+	RUN_TEST(test_inline_and_long_keys);
+	RUN_TEST(test_string_compare);
+	RUN_TEST(test_set_and_is_member);
+	RUN_TEST(test_ownership);
+	RUN_TEST(test_int64_keys);
+	RUN_TEST(test_other_key_types);
+	RUN_TEST(test_custom_comparator);
+	RUN_TEST(test_typed_tree);
+	RUN_TEST(test_insert_hint_and_finger_search);
+	RUN_TEST(test_stats);
+	RUN_TEST(test_profile);
+	RUN_TEST(test_sentinel_is_never_written);
+	RUN_TEST(test_compact_color);
+	RUN_TEST(test_delete_black_leaf);
+	RUN_TEST(test_upsert_and_delete_key);
+	RUN_TEST(test_build_sorted);
+	RUN_TEST(test_search_batch);
+	RUN_TEST(test_bounds_and_range);
+	RUN_TEST(test_iterator);
+	RUN_TEST(test_order_statistics);
+	RUN_TEST(test_interval_tree);
+	RUN_TEST(test_aggregate_range);
+	RUN_TEST(test_validate);
+	RUN_TEST(test_topdown_tree);
+	RUN_TEST(test_arena_tree);
+	RUN_TEST(test_persistent_tree);
 	UNITY_END();
 
 	return 0;